@@ -12,6 +12,7 @@ class processmap(object):
         self._mapcache = {}
         self._empty = "\xff" * 1024
         class mapping(object): pass
+        fm = file("/proc/%s/pagemap" % self._pid, "r", 0) # uncached
         for l in file("/proc/%s/maps" % self._pid):
             m = re.match(r"(\w+)-(\w+) (\S+) (\S+) (\S+) (\d+)\s+(\S*)", l)
             start, end, prot, offset, dev, huh, name = m.groups()
@@ -22,8 +23,16 @@ class processmap(object):
             a.prot = prot
             a.dev = dev
             a.name = name
+            # seek to this mapping's entries instead of reading a fixed
+            # prefix of pagemap; no-access mappings have no pages
+            a.data = ""
+            if prot[:3] != "---":
+                try:
+                    fm.seek((a.start / 4096) * 8)
+                    a.data = fm.read(((a.end - a.start) / 4096) * 8)
+                except IOError:
+                    pass
             self._maps.append(a)
-        self.data = file("/proc/%s/pagemap" % self._pid, "r", 0).read(6*2**20)
 
     def __getitem__(self, page):
         return self._mapcache[addr>>20][(addr>>12)&255]
@@ -31,29 +40,42 @@ class processmap(object):
     def maps(self):
         return self._maps
 
+    # unmapped pages read as 0, as they do in pagemap itself
     def range(self, startaddr, endaddr):
-        off = (startaddr / 4096) * 8
         size = ((endaddr - startaddr) / 4096)
-        d = self.data[off:off + size * 8]
+        m = self.findmap(startaddr)
+        d = ""
+        if m:
+            off = ((startaddr - m.start) / 4096) * 8
+            d = m.data[off:off + size * 8]
+        d += "\0" * (size * 8 - len(d))
         if len(d):
             q = "Q" * size
             l = struct.unpack(q, d)
             return array.array("L", l)
         return []
-        fm = file("/proc/%s/pagemap" % self._pid, "r", 0) # uncached
-        fm.seek(off)
-        return array.array("L", fm.read(size))
 
     def findmap(self, addr):
         for m in self._maps:
-            if addr >= m.start and addr <= m.end:
+            if addr >= m.start and addr < m.end:
                 return m
 
+# all of a /proc/kpage* file, not just the first 16 GB of frames
+def readall(path):
+    f = file(path, "r", 0)
+    chunks = []
+    while True:
+        d = f.read(8*2**20)
+        if not d:
+            break
+        chunks.append(d)
+    return "".join(chunks)
+
 class kpagecount(object):
     def __init__(self):
         self.l = ""
         try:
-            self.data = file("/proc/kpagecount", "r", 0).read(8*2**22)
+            self.data = readall("/proc/kpagecount")
         except:
             self.data = "\0" * 4 * 2**20
 
@@ -75,7 +97,7 @@ class kpageflags(object):
     def __init__(self):
         self.l = ""
         try:
-            self.data = file("/proc/kpageflags", "r", 0).read(8*2**22)
+            self.data = readall("/proc/kpageflags")
         except:
             self.data = "\0" * 4 * 2**20
 
@@ -92,3 +114,28 @@ class kpageflags(object):
         off = page * 8
         data = self.data[off:off + 8]
         return struct.unpack("Q", data)
+
+# reader of the binary stream of pin_tools/pagemapd (pagemap_stream.H):
+# frames of (vpn, old pfn, new pfn, mapcount) deltas, PFN 0 = not present
+class changestream(object):
+    FRAME = "IIIIQ"
+    DELTA = "QQQQ"
+    MAGIC = 0x314d5050
+
+    def __init__(self, path):
+        self.f = file(path, "rb")
+        self.fsize = struct.calcsize(self.FRAME)
+        self.dsize = struct.calcsize(self.DELTA)
+
+    # next (pid, seq, [(vpn, old, new, mapcount), ...]), None at the end
+    def next(self):
+        h = self.f.read(self.fsize)
+        if len(h) < self.fsize:
+            return None
+        magic, pid, seq, count, t = struct.unpack(self.FRAME, h)
+        if magic != self.MAGIC:
+            raise IOError("not a pagemapd stream")
+        d = self.f.read(count * self.dsize)
+        deltas = [struct.unpack_from(self.DELTA, d, i * self.dsize)
+                  for i in range(len(d) / self.dsize)]
+        return pid, seq, deltas
@@ -0,0 +1,102 @@
+#!/bin/bash
+#
+# Benchmark the trace pipeline, one JSON line per measurement:
+#   - the synthetic workloads natively
+#   - the same under mem_trace_st and mem_trace_mt_FAST_bufAPI, with the
+#     slowdown against native and the records and bytes of trace written
+#     per second, if PIN is set
+#   - the offline utilities on traces from tracegen
+#
+# Run from pin_tools after "make bench" (or "make utils bench").  Settings
+# come from the environment:
+#   OBJDIR    where the tools and utilities are (obj-intel64/)
+#   PIN       the pin launcher; without it the pin tools are skipped
+#   MB        workload size (64), PASSES (4), THREADS (4)
+#   RECORDS   records per synthetic trace (4000000)
+#   SCRATCH   scratch directory, kept (default: a new one under /tmp,
+#             removed at the end)
+#
+# e.g. PIN=../../../pin bench/run_bench.sh > bench.json
+
+OBJDIR=${OBJDIR:-obj-intel64/}
+MB=${MB:-64}
+PASSES=${PASSES:-4}
+THREADS=${THREADS:-4}
+RECORDS=${RECORDS:-4000000}
+if [ -z "$SCRATCH" ]; then
+    TMP=$(mktemp -d /tmp/vabench.XXXXXX)
+    trap 'rm -rf $TMP' EXIT
+else
+    TMP=$SCRATCH
+fi
+
+now() { date +%s.%N; }
+
+# the "seconds" of a workload JSON line
+seconds() { sed 's/.*"seconds": \([0-9.]*\).*/\1/'; }
+
+# records in a raw binary trace, from the header_size and record_size
+# fields of its header
+records() {
+    local hdr rec size
+    hdr=$(od -An -tu4 -j12 -N4 "$1" | tr -d ' ')
+    rec=$(od -An -tu4 -j24 -N4 "$1" | tr -d ' ')
+    size=$(stat -c %s "$1")
+    echo $(( (size - hdr) / rec ))
+}
+
+# <name> <records> <bytes> <command>...: time an offline run
+offline() {
+    local name=$1 recs=$2 bytes=$3 start end
+    shift 3
+    start=$(now)
+    "$@" > /dev/null || { echo "$name failed" >&2; return; }
+    end=$(now)
+    awk -v n="$name" -v r="$recs" -v b="$bytes" -v s="$start" -v e="$end" 'BEGIN {
+        t = e - s; if (t <= 0) t = 1e-6
+        printf "{\"component\": \"%s\", \"records\": %d, \"bytes\": %d, \"seconds\": %.6f, " \
+               "\"records_per_s\": %.0f, \"bytes_per_s\": %.0f}\n", n, r, b, t, r / t, b / t }'
+}
+
+for w in stream chase stride shared private huge; do
+    native=$(${OBJDIR}workload $w $MB $PASSES $THREADS)
+    echo "$native"
+    [ -z "$PIN" ] && continue
+    base=$(echo "$native" | seconds)
+
+    for tool in mem_trace_st mem_trace_mt_FAST_bufAPI; do
+        rm -f $TMP/$tool.out*
+        start=$(now)
+        $PIN -t ${OBJDIR}$tool.so -o $TMP/$tool.out -- \
+            ${OBJDIR}workload $w $MB $PASSES $THREADS > /dev/null || continue
+        end=$(now)
+        recs=0
+        bytes=0
+        for f in $TMP/$tool.out*; do
+            recs=$(( recs + $(records $f) ))
+            bytes=$(( bytes + $(stat -c %s $f) ))
+        done
+        awk -v w=$w -v tool=$tool -v r=$recs -v by=$bytes -v b=$base -v s=$start -v e=$end 'BEGIN {
+            t = e - s; if (t <= 0) t = 1e-6
+            printf "{\"workload\": \"%s\", \"tool\": \"%s\", \"records\": %d, \"bytes\": %d, " \
+                   "\"seconds\": %.6f, \"slowdown\": %.1f, \"records_per_s\": %.0f, " \
+                   "\"bytes_per_s\": %.0f}\n", w, tool, r, by, t, t / b, r / t, by / t }'
+    done
+done
+
+# offline components
+${OBJDIR}tracegen -n $RECORDS -p chase $TMP/gen.raw
+${OBJDIR}tracegen -n $RECORDS -p chase -f lz $TMP/gen.lz
+${OBJDIR}tracegen -n $RECORDS -p chase -f text $TMP/gen.txt
+${OBJDIR}tracegen -n $(( RECORDS / THREADS )) -p chase -t $THREADS $TMP/gen.mt
+raw=$(stat -c %s $TMP/gen.raw)
+
+offline trace2text $RECORDS $raw ${OBJDIR}trace2text $TMP/gen.raw $TMP/out.txt
+offline trace2text_lz $RECORDS $(stat -c %s $TMP/gen.lz) \
+    ${OBJDIR}trace2text $TMP/gen.lz $TMP/out.txt
+offline reuse $RECORDS $raw ${OBJDIR}reuse $TMP/gen.raw 1 $TMP/out.reuse
+offline vatrace $RECORDS $(stat -c %s $TMP/gen.txt) \
+    ${OBJDIR}vatrace $TMP/gen.txt $TMP/out.pa
+offline trace_merge $(( RECORDS / THREADS * THREADS )) $(cat $TMP/gen.mt.* | wc -c) \
+    ${OBJDIR}trace_merge $TMP/out.merged $TMP/gen.mt.*
+
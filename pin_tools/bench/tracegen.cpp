@@ -0,0 +1,326 @@
+/*
+ * tracegen: synthetic traces for benchmarking the offline utilities
+ * (trace2text, reuse, trace_merge, vatrace) without running Pin
+ *
+ *   -n <records>   per thread, 1M by default
+ *   -p <pattern>   stream, chase (random), stride (one per 4 KB page)
+ *   -w <KB>        working set, 64 MB by default
+ *   -t <threads>   more than 1: one trace per thread, <output>.<tid>,
+ *                  with timestamps, as mem_trace_mt_FAST_bufAPI writes
+ *   -f <format>    raw, delta, lz (trace_codec.H) or text: trace2text
+ *                  lines followed by a gen_PA.py mapping dump of every
+ *                  page touched, the input of vatrace
+ *   -s <seed>
+ *
+ * The single thread binary traces have the layout of mem_trace_st,
+ * with an ROI begin and end marker around the records.
+ *
+ * usage: tracegen [options] <output>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <set>
+#include <vector>
+#include "trace_format.H"
+#include "trace_codec.H"
+
+// records per chunk of a compressed trace, about one Pin buffer
+#define CHUNK_RECORDS  (1 << 15)
+
+// base of the synthetic heap and of the code
+#define HEAP_BASE  0x7f0000000000ULL
+#define CODE_BASE  0x400000ULL
+
+struct ST_REC
+{
+  uint64_t    pc;
+  uint64_t    ea;
+  uint32_t    size;
+  uint32_t    read;
+  uint64_t    icount;
+};
+
+struct MT_REC
+{
+  uint64_t    pc;
+  uint64_t    ea;
+  uint32_t    size;
+  uint32_t    thread_id;
+  uint32_t    read;
+  uint32_t    pad;
+  uint64_t    timestamp;
+};
+
+enum PATTERN { PATTERN_STREAM, PATTERN_CHASE, PATTERN_STRIDE };
+
+class GENERATOR
+{
+  public:
+    GENERATOR(PATTERN p, uint64_t wsBytes, unsigned seed)
+      : _pattern(p), _lines(wsBytes / 64), _i(0), _seed(seed)
+    {
+      if (_lines == 0)
+        _lines = 1;
+    }
+
+    // next effective address, pc and whether it is a read
+    void Next(uint64_t *ea, uint64_t *pc, bool *read)
+    {
+      uint64_t line;
+      if (_pattern == PATTERN_STREAM)
+        line = _i % _lines;
+      else if (_pattern == PATTERN_STRIDE)
+        line = (_i * 64 + _i / (_lines / 64 + 1)) % _lines;
+      else
+        line = Random() % _lines;
+      _i++;
+      *ea = HEAP_BASE + line * 64 + (Random() & 7) * 8;
+      *pc = CODE_BASE + (Random() % 256) * 4;
+      *read = Random() % 3 != 0;
+    }
+
+  private:
+    uint64_t Random()
+    {
+      // xorshift64*
+      _seed ^= _seed >> 12;
+      _seed ^= _seed << 25;
+      _seed ^= _seed >> 27;
+      return _seed * 2685821657736338717ULL;
+    }
+
+    PATTERN     _pattern;
+    uint64_t    _lines;
+    uint64_t    _i;
+    uint64_t    _seed;
+};
+
+static bool Fail(const char *what, const char *path)
+{
+  fprintf(stderr, "could not %s %s\n", what, path);
+  return false;
+}
+
+/*
+ * Write records to fd, as they are or as compressed chunks
+ */
+class OUTPUT
+{
+  public:
+    OUTPUT(int fd, TRACE_HEADER *hdr) : _fd(fd), _hdr(hdr)
+    {
+      memset(&_state, 0, sizeof(_state));
+    }
+
+    bool Write(const char *recs, size_t n)
+    {
+      if (_hdr->encoding == TRACE_ENCODING_RAW)
+        return TRACE_WriteAll(_fd, recs, n * _hdr->record_size);
+
+      _delta.resize(sizeof(TRACE_CHUNK) + TRACE_MaxEncodedSize(_hdr, n));
+      TRACE_CHUNK chunk;
+      chunk.tid = 0;
+      chunk.records = n;
+      chunk.encoded_len = TRACE_EncodeRecords(_hdr, recs, n, &_state,
+                                              &_delta[sizeof(chunk)]);
+      chunk.stored_len = chunk.encoded_len;
+      uint8_t *out = &_delta[0];
+      if (_hdr->encoding == TRACE_ENCODING_DELTA_LZ)
+        {
+          _lz.resize(sizeof(TRACE_CHUNK) + TRACE_LzBound(chunk.encoded_len));
+          size_t len = TRACE_LzCompress(&_delta[sizeof(chunk)], chunk.encoded_len,
+                                        &_lz[sizeof(chunk)]);
+          if (len < chunk.encoded_len)
+            {
+              chunk.stored_len = len;
+              out = &_lz[0];
+            }
+        }
+      memcpy(out, &chunk, sizeof(chunk));
+      return TRACE_WriteAll(_fd, out, sizeof(chunk) + chunk.stored_len);
+    }
+
+  private:
+    int                   _fd;
+    TRACE_HEADER *        _hdr;
+    TRACE_CODEC_STATE     _state;
+    std::vector<uint8_t>  _delta;
+    std::vector<uint8_t>  _lz;
+};
+
+static bool SingleThread(const char *path, GENERATOR &gen, uint64_t records,
+                         uint32_t encoding)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return Fail("open", path);
+  TRACE_HEADER hdr;
+  TRACE_InitHeader(&hdr, sizeof(ST_REC));
+  hdr.thread_count = 1;
+  hdr.encoding = encoding;
+  TRACE_SetField(&hdr, TRACE_FIELD_PC, offsetof(ST_REC, pc), sizeof(uint64_t));
+  TRACE_SetField(&hdr, TRACE_FIELD_EA, offsetof(ST_REC, ea), sizeof(uint64_t));
+  TRACE_SetField(&hdr, TRACE_FIELD_SIZE, offsetof(ST_REC, size), sizeof(uint32_t));
+  TRACE_SetField(&hdr, TRACE_FIELD_READ, offsetof(ST_REC, read), sizeof(uint32_t));
+  TRACE_SetField(&hdr, TRACE_FIELD_ICOUNT, offsetof(ST_REC, icount), sizeof(uint64_t));
+  TRACE_WriteAll(fd, &hdr, sizeof(hdr));
+
+  OUTPUT out(fd, &hdr);
+  std::vector<ST_REC> buf(CHUNK_RECORDS);
+  ST_REC marker;
+  memset(&marker, 0, sizeof(marker));
+  marker.size = TRACE_MARKER_ROI_BEGIN;
+  out.Write((const char *) &marker, 1);
+  for (uint64_t done = 0; done < records; )
+    {
+      size_t n = records - done < CHUNK_RECORDS ? records - done : CHUNK_RECORDS;
+      for (size_t i = 0; i < n; i++)
+        {
+          bool read;
+          gen.Next(&buf[i].ea, &buf[i].pc, &read);
+          buf[i].size = 8;
+          buf[i].read = read;
+          buf[i].icount = 1 + (buf[i].pc & 3);
+        }
+      if (!out.Write((const char *) &buf[0], n))
+        return Fail("write", path);
+      done += n;
+    }
+  marker.size = TRACE_MARKER_ROI_END;
+  out.Write((const char *) &marker, 1);
+  close(fd);
+  return true;
+}
+
+static bool MultiThread(const char *prefix, PATTERN pattern, uint64_t ws,
+                        unsigned seed, uint64_t records, unsigned threads)
+{
+  for (unsigned t = 0; t < threads; t++)
+    {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s.%u", prefix, t);
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+        return Fail("open", path);
+      TRACE_HEADER hdr;
+      TRACE_InitHeader(&hdr, sizeof(MT_REC));
+      hdr.thread_count = 1;
+      TRACE_SetField(&hdr, TRACE_FIELD_PC, offsetof(MT_REC, pc), sizeof(uint64_t));
+      TRACE_SetField(&hdr, TRACE_FIELD_EA, offsetof(MT_REC, ea), sizeof(uint64_t));
+      TRACE_SetField(&hdr, TRACE_FIELD_SIZE, offsetof(MT_REC, size), sizeof(uint32_t));
+      TRACE_SetField(&hdr, TRACE_FIELD_THREAD_ID, offsetof(MT_REC, thread_id),
+                     sizeof(uint32_t));
+      TRACE_SetField(&hdr, TRACE_FIELD_READ, offsetof(MT_REC, read), sizeof(uint32_t));
+      TRACE_SetField(&hdr, TRACE_FIELD_TIMESTAMP, offsetof(MT_REC, timestamp),
+                     sizeof(uint64_t));
+      TRACE_WriteAll(fd, &hdr, sizeof(hdr));
+
+      GENERATOR gen(pattern, ws, seed + t);
+      std::vector<MT_REC> buf(CHUNK_RECORDS);
+      uint64_t now = 1000 + t;
+      for (uint64_t done = 0; done < records; )
+        {
+          size_t n = records - done < CHUNK_RECORDS ? records - done : CHUNK_RECORDS;
+          for (size_t i = 0; i < n; i++)
+            {
+              MT_REC &r = buf[i];
+              bool read;
+              gen.Next(&r.ea, &r.pc, &read);
+              r.size = 8;
+              r.thread_id = t;
+              r.read = read;
+              r.pad = 0;
+              // threads run at slightly different speeds
+              now += 1 + ((r.pc >> 2) + t) % 4;
+              r.timestamp = now;
+            }
+          if (!TRACE_WriteAll(fd, &buf[0], n * sizeof(MT_REC)))
+            return Fail("write", path);
+          done += n;
+        }
+      close(fd);
+    }
+  return true;
+}
+
+static bool Text(const char *path, GENERATOR &gen, uint64_t records)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    return Fail("open", path);
+  std::set<uint64_t> pages;
+  fprintf(f, "# page size 4096, pointer width 8, record size 32, threads 1\n");
+  for (uint64_t i = 0; i < records; i++)
+    {
+      uint64_t ea, pc;
+      bool read;
+      gen.Next(&ea, &pc, &read);
+      pages.insert(ea >> 12);
+      fprintf(f, "%llu %llu 8 %u\n", (unsigned long long) pc,
+              (unsigned long long) ea, read ? 1 : 0);
+    }
+  fprintf(f, "#eof\n");
+
+  // gen_PA.py: the regions, then every present page
+  fprintf(f, "%08llx-%08llx [heap]\n", (unsigned long long) (*pages.begin() << 12),
+          (unsigned long long) ((*pages.rbegin() + 1) << 12));
+  uint64_t pfn = 0x100000;
+  for (std::set<uint64_t>::const_iterator p = pages.begin(); p != pages.end(); ++p)
+    fprintf(f, "addr = %012llx VPN = %012llx, PFN = %012llx\n",
+            (unsigned long long) (*p << 12), (unsigned long long) *p,
+            (unsigned long long) (pfn += 1 + (*p & 1)));
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t records = 1 << 20;
+  uint64_t ws = 64 << 20;
+  unsigned threads = 1, seed = 1;
+  PATTERN pattern = PATTERN_STREAM;
+  const char *format = "raw";
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:w:t:f:s:")) != -1)
+    {
+      if (opt == 'n')
+        records = strtoull(optarg, NULL, 0);
+      else if (opt == 'p')
+        pattern = strcmp(optarg, "chase") == 0 ? PATTERN_CHASE
+          : strcmp(optarg, "stride") == 0 ? PATTERN_STRIDE : PATTERN_STREAM;
+      else if (opt == 'w')
+        ws = strtoull(optarg, NULL, 0) << 10;
+      else if (opt == 't')
+        threads = atoi(optarg);
+      else if (opt == 'f')
+        format = optarg;
+      else if (opt == 's')
+        seed = atoi(optarg);
+      else
+        optind = argc;
+    }
+  if (optind >= argc)
+    {
+      fprintf(stderr, "usage: %s [-n <records>] [-p stream|chase|stride] [-w <KB>] "
+              "[-t <threads>] [-f raw|delta|lz|text] [-s <seed>] <output>\n", argv[0]);
+      return 1;
+    }
+
+  GENERATOR gen(pattern, ws, seed);
+  bool ok;
+  if (threads > 1)
+    ok = MultiThread(argv[optind], pattern, ws, seed, records, threads);
+  else if (strcmp(format, "text") == 0)
+    ok = Text(argv[optind], gen, records);
+  else
+    {
+      uint32_t encoding = strcmp(format, "delta") == 0 ? TRACE_ENCODING_DELTA
+        : strcmp(format, "lz") == 0 ? TRACE_ENCODING_DELTA_LZ : TRACE_ENCODING_RAW;
+      ok = SingleThread(argv[optind], gen, records, encoding);
+    }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+/*
+ * workload: small synthetic memory access patterns, to measure the
+ * overhead of the pin tools against native runs (see run_bench.sh)
+ *
+ *   stream    sequential read-modify-write of an array
+ *   chase     pointer chase along one random cycle through the array
+ *   stride    one access per 4 KB page, wrapping around the array
+ *   shared    threads read all of one array and write their own cache
+ *             lines of it
+ *   private   threads stream over arrays of their own
+ *   huge      stream over a 2 MB aligned heap region given to THP
+ *             with madvise(MADV_HUGEPAGE)
+ *
+ * The timed loops run between __parsec_roi_begin() and
+ * __parsec_roi_end(), so the tools' ROI gating covers the same part as
+ * with PARSEC.  The result is one JSON line on stdout.
+ *
+ * usage: workload <kind> [<MB> [<passes> [<threads>]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <vector>
+
+extern "C" {
+  // found by name by the pin tools
+  void __attribute__((noinline)) __parsec_roi_begin() { __asm__ volatile(""); }
+  void __attribute__((noinline)) __parsec_roi_end() { __asm__ volatile(""); }
+}
+
+static volatile uint64_t sink;
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t * Alloc(size_t bytes, bool huge)
+{
+  void *p = NULL;
+  if (posix_memalign(&p, huge ? (2 << 20) : 4096, bytes) != 0)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+  memset(p, 1, bytes);
+  return (uint64_t *) p;
+}
+
+// accesses made, returned by the kernels
+static uint64_t Stream(uint64_t *a, size_t n, unsigned passes)
+{
+  for (unsigned p = 0; p < passes; p++)
+    for (size_t i = 0; i < n; i++)
+      a[i] += i;
+  return 2ULL * n * passes;
+}
+
+// Sattolo's shuffle: a single cycle through every slot
+static void ChaseInit(uint64_t *a, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    a[i] = i;
+  for (size_t i = n - 1; i > 0; i--)
+    {
+      size_t j = (size_t) (((uint64_t) rand() << 16 ^ rand()) % i);
+      uint64_t t = a[i];
+      a[i] = a[j];
+      a[j] = t;
+    }
+}
+
+static uint64_t Chase(uint64_t *a, size_t n, unsigned passes)
+{
+  uint64_t at = 0;
+  for (unsigned p = 0; p < passes; p++)
+    for (size_t i = 0; i < n; i++)
+      at = a[at];
+  sink = at;
+  return (uint64_t) n * passes;
+}
+
+static uint64_t Stride(uint64_t *a, size_t n, unsigned passes)
+{
+  const size_t step = 4096 / sizeof(uint64_t);
+  uint64_t sum = 0, count = 0;
+  for (unsigned p = 0; p < passes; p++)
+    for (size_t off = 0; off < step; off += 8)
+      for (size_t i = off; i < n; i += step, count++)
+        sum += a[i];
+  sink = sum;
+  return count;
+}
+
+struct THREAD_ARG
+{
+  uint64_t *    a;
+  size_t        n;
+  unsigned      passes;
+  unsigned      id;
+  unsigned      threads;
+  uint64_t      accesses;
+};
+
+static void * SharedMain(void *p)
+{
+  THREAD_ARG *t = (THREAD_ARG *) p;
+  uint64_t sum = 0, count = 0;
+  for (unsigned pass = 0; pass < t->passes; pass++)
+    for (size_t i = 0; i < t->n; i++, count++)
+      {
+        sum += t->a[i];
+        // cache lines (8 words) are handed out round robin
+        if ((i / 8) % t->threads == t->id)
+          {
+            t->a[i] = sum;
+            count++;
+          }
+      }
+  sink = sum;
+  t->accesses = count;
+  return NULL;
+}
+
+static void * PrivateMain(void *p)
+{
+  THREAD_ARG *t = (THREAD_ARG *) p;
+  t->accesses = Stream(t->a, t->n, t->passes);
+  return NULL;
+}
+
+// arrays: one per thread of n / threads words, or empty for shared
+static uint64_t Threaded(void * (*fn)(void *), uint64_t *shared,
+                         const std::vector<uint64_t *> &arrays, size_t n,
+                         unsigned passes, unsigned threads)
+{
+  std::vector<THREAD_ARG> args(threads);
+  std::vector<pthread_t> ids(threads);
+  for (unsigned t = 0; t < threads; t++)
+    {
+      THREAD_ARG a = { shared, n, passes, t, threads, 0 };
+      if (!arrays.empty())
+        {
+          a.a = arrays[t];
+          a.n = n / threads;
+        }
+      args[t] = a;
+    }
+  for (unsigned t = 0; t < threads; t++)
+    pthread_create(&ids[t], NULL, fn, &args[t]);
+  uint64_t accesses = 0;
+  for (unsigned t = 0; t < threads; t++)
+    {
+      pthread_join(ids[t], NULL);
+      accesses += args[t].accesses;
+    }
+  return accesses;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: %s stream|chase|stride|shared|private|huge "
+              "[<MB> [<passes> [<threads>]]]\n", argv[0]);
+      return 1;
+    }
+  const char *kind = argv[1];
+  size_t bytes = (size_t) (argc > 2 ? atoi(argv[2]) : 64) << 20;
+  unsigned passes = argc > 3 ? atoi(argv[3]) : 4;
+  unsigned threads = argc > 4 ? atoi(argv[4]) : 4;
+  if (threads == 0)
+    threads = 1;
+  size_t n = bytes / sizeof(uint64_t);
+  bool huge = strcmp(kind, "huge") == 0;
+  bool priv = strcmp(kind, "private") == 0;
+  uint64_t *a = priv ? NULL : Alloc(bytes, huge);
+  if (strcmp(kind, "chase") == 0)
+    ChaseInit(a, n);
+  // the private arrays split the size
+  std::vector<uint64_t *> arrays;
+  for (unsigned t = 0; priv && t < threads; t++)
+    arrays.push_back(Alloc(n / threads * sizeof(uint64_t), false));
+
+  double start = Now();
+  __parsec_roi_begin();
+  uint64_t accesses;
+  if (strcmp(kind, "stream") == 0 || huge)
+    accesses = Stream(a, n, passes);
+  else if (strcmp(kind, "chase") == 0)
+    accesses = Chase(a, n, passes);
+  else if (strcmp(kind, "stride") == 0)
+    accesses = Stride(a, n, passes);
+  else if (strcmp(kind, "shared") == 0)
+    accesses = Threaded(SharedMain, a, arrays, n, passes, threads);
+  else if (priv)
+    accesses = Threaded(PrivateMain, NULL, arrays, n, passes, threads);
+  else
+    {
+      fprintf(stderr, "unknown workload %s\n", kind);
+      return 1;
+    }
+  __parsec_roi_end();
+  double seconds = Now() - start;
+
+  printf("{\"workload\": \"%s\", \"bytes\": %llu, \"passes\": %u, \"threads\": %u, "
+         "\"accesses\": %llu, \"seconds\": %.6f}\n", kind, (unsigned long long) bytes,
+         passes, strcmp(kind, "shared") == 0 || priv ? threads : 1,
+         (unsigned long long) accesses, seconds);
+  return 0;
+}
@@ -242,9 +242,9 @@ class processmap(object):
             a.dev = dev
             a.name = name
             self._maps.append(a)
-        # 6*2^20 Bytes are read coz there are 2^20 page of 4KB each in a 
-        # 32-bit machine. Why 6? Dunno yet :-)
-        self.data = file("/proc/%s/pagemap" % self._pid, "r", 0).read(6*2**20)
+        # pagemap is read per mapping in range_to_pfn, seeking straight
+        # to the mapping's entries
+        self._pagemap = file("/proc/%s/pagemap" % self._pid, "r", 0)
 
     def maps(self):
         return self._maps
@@ -255,8 +255,14 @@ class processmap(object):
         off = (startaddr / 4096) * 8
         size = ((endaddr - startaddr) / 4096)
 
+        try:
+            self._pagemap.seek(off)
+            data = self._pagemap.read(size * 8)
+        except IOError:
+            return []
+
         for i in range(size) : 
-            d = self.data[off+i*8:off+(i+1)*8]
+            d = data[i*8:(i+1)*8]
             if len(d):
                 q = "Q"
                 l = struct.unpack(q,d)
@@ -269,19 +275,18 @@ class processmap(object):
                 # 0x7FFFFFFFFFFFFF = 36028797018963967
                 pfn = (arr_here[0] & 36028797018963967)
 
-                if pg_present and not pg_swapped and not pg_size == 4096 : 
-                    raise AssertionError
+                # huge pages (hugetlbfs, THP) still have one entry per
+                # 4KB page here, so there is nothing to special-case.
+                # Kernels after 3.11 reuse bits 55-60 for other flags, so
+                # pg_size is only meaningful on older kernels.
                 
                 #if pg_present and not pg_swapped :
                 if pfn != 0 :
-                    vpn = off+i*8
+                    vpn = startaddr / 4096 + i
                     addr = startaddr + i*4096
                     print >> trace_file, "addr = %012x VPN = %012x, PFN = %012x" % (addr,vpn,pfn)
 
         return []
-        fm = file("/proc/%s/pagemap" % self._pid, "r", 0) # uncached
-        fm.seek(off)
-        return array.array("L", fm.read(size))
 
 
 # Begin main section
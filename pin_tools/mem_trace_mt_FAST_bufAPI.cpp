@@ -1,12 +1,68 @@
 #include <stdio.h>
+#include <fcntl.h>
 #include "pin.H"
+#include "trace_format.H"
+#include "trace_writer.H"
+#include "trace_mmap.H"
+#include "page_heat.H"
+#include "line_sharing.H"
+#include "tlb_sim.H"
+#include "map_watch.H"
 
 #define PIN_FAST_ANALYSIS_CALL
 
 using namespace std;
 
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
-    "o", "malloc_mt.out", "specify output file name");
+    "o", "malloc_mt.out", "specify output file name prefix, "
+    "each thread writes to <prefix>.<thread id>");
+
+KNOB<UINT32> KnobWriters(KNOB_MODE_WRITEONCE, "pintool",
+    "writers", "2", "number of internal threads writing the trace");
+
+KNOB<UINT32> KnobQueueDepth(KNOB_MODE_WRITEONCE, "pintool",
+    "queue", "8", "full buffers queued per writer thread before the "
+    "application thread has to wait");
+
+KNOB<UINT32> KnobMmap(KNOB_MODE_WRITEONCE, "pintool",
+    "mmap", "0", "write each trace through a mapped window of that many MB "
+    "of the file, preallocated, instead of write() (0: write())");
+
+KNOB<BOOL> KnobHeatmap(KNOB_MODE_WRITEONCE, "pintool",
+    "heatmap", "0", "instead of the traces, write a per-page profile "
+    "(reads, writes, first and last touch, threads, frame, region) to "
+    "<prefix>");
+
+KNOB<BOOL> KnobSharing(KNOB_MODE_WRITEONCE, "pintool",
+    "sharing", "0", "instead of the traces, find cache lines written by one "
+    "thread and accessed by another, true or false sharing, and write them "
+    "with the PCs writing them to <prefix>.sharing");
+
+KNOB<UINT32> KnobSharingLines(KNOB_MODE_WRITEONCE, "pintool",
+    "sharing_lines", "1048576", "cache lines the -sharing table has room for");
+
+KNOB<UINT32> KnobSharingTop(KNOB_MODE_WRITEONCE, "pintool",
+    "sharing_top", "50", "shared lines and PCs listed by -sharing");
+
+KNOB<BOOL> KnobTlbSim(KNOB_MODE_WRITEONCE, "pintool",
+    "tlbsim", "0", "instead of the traces, simulate the TLBs and write the "
+    "statistics to <prefix>.tlb");
+
+KNOB<string> KnobDtlb4K(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_4k", "64:4", "L1 dTLB for 4 KB pages, <entries>:<assoc>");
+
+KNOB<string> KnobDtlb2M(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_2m", "32:4", "L1 dTLB for 2 MB pages");
+
+KNOB<string> KnobDtlb1G(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_1g", "4:4", "L1 dTLB for 1 GB pages");
+
+KNOB<string> KnobStlb(KNOB_MODE_WRITEONCE, "pintool",
+    "stlb", "1536:12", "second level TLB for 4 KB and 2 MB pages");
+
+KNOB<string> KnobPwc(KNOB_MODE_WRITEONCE, "pintool",
+    "pwc", "", "page walk caches, one per upper level, e.g. 32:4 "
+    "(empty: none)");
 
 /*
  * The ID of the buffer
@@ -22,6 +78,11 @@ BUFFER_ID bufId;
  * Record of memory references.  Rather than having two separate
  * buffers for reads and writes, we just use one struct that includes a
  * flag for type.
+ *
+ * timestamp is the TSC when the reference was made: every thread's
+ * records are in order of it, and trace_merge interleaves the thread
+ * files into one trace by it.  The TSC is synchronized across cores on
+ * the machines we trace on (constant_tsc, nonstop_tsc).
  */
 struct MEMREF
 {
@@ -30,74 +91,135 @@ struct MEMREF
   UINT32      size;
   UINT32      thread_id;
   BOOL        read;
+  UINT64      timestamp;
 };
 
 
+/*
+ * Upper bound on the application threads we keep a trace file for
+ */
+#define MAX_THREADS 1024
+
 //==============================================================
 //  Analysis Routines
 //==============================================================
-// Note:  threadid+1 is used as an argument to the GetLock()
-//        routine.  This is the value that the lock is set to, 
-//        so it must be non-zero.
 
-// lock serializes access to the output file.
-FILE* trace;
-PIN_LOCK lock;
+// Each thread has its own trace file, <prefix>.<thread id>, in the
+// binary format of trace_format.H.  Only the writer thread that owns
+// a thread's queue touches its file, so no lock is needed.
+int trace_fd[MAX_THREADS];
+TRACE_HEADER trace_header;
 
-// This routine is executed every time a thread is created.
-VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
-{
-    GetLock(&lock, threadid+1);
-    fprintf(trace, "thread begin %d\n",threadid);
-    fflush(trace);
-    ReleaseLock(&lock);
-}
+// -mmap: the window of each thread's file, also only used by its writer
+TRACE_MMAP_OUTPUT * trace_out[MAX_THREADS];
+
+// Set once a write to a thread's file failed (no space left, say): the
+// tracing of that thread stops there
+BOOL trace_failed[MAX_THREADS];
 
-// This routine is executed every time a thread is destroyed.
-VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
+VOID WriteTrace(THREADID tid, const VOID *buf, size_t len)
 {
-    GetLock(&lock, threadid+1);
-    fprintf(trace, "thread end %d code %d\n",threadid, code);
-    fflush(trace);
-    ReleaseLock(&lock);
+    if (trace_failed[tid])
+        return;
+    bool written = trace_out[tid] != NULL ? trace_out[tid]->Write(buf, len)
+        : TRACE_WriteAll(trace_fd[tid], buf, len);
+    if (!written)
+    {
+        printf("Error: could not write the trace of thread %u, its tracing stops\n",
+               (unsigned) tid);
+        trace_failed[tid] = TRUE;
+    }
 }
 
-// Print a memory read record
-VOID PIN_FAST_ANALYSIS_CALL RecordMemRead(VOID * ip, VOID * addr, THREADID thread_id)
+// Writer threads draining the full buffers
+TRACE_WRITER_POOL writers;
+
+// -heatmap: the pages each thread touched, folded in by its own
+// BufferFull, so no lock is needed either
+PAGE_HEAT_TABLE * heat[MAX_THREADS];
+UINT32 page_shift = 0;
+
+// -sharing: one table of 64 byte lines for all threads, updated with
+// atomics; each thread's run of references to its current line
+LINE_SHARING sharing;
+LINE_RUN sharing_run[MAX_THREADS];
+
+// -tlbsim: one set of TLBs for all threads, under tlb_lock, with the
+// page sizes from our own pagemap reader.  The records carry no
+// instruction counts, so each thread counts its own per basic block,
+// in a line of its own, and hands them over at every flush.
+// map_watch invalidates the translations mapping calls change; before
+// such a call the thread's buffered records are simulated up to there,
+// and tlb_pending marks where its buffer is not simulated yet.
+TLB_SIM tlbs;
+PA_TRANSLATOR translator;
+std::vector<VMA> tlb_maps;
+PIN_LOCK tlb_lock;
+MAP_WATCH map_watch;
+struct MEMREF * tlb_pending[MAX_THREADS];
+
+struct THREAD_ICOUNT
 {
-  GetLock(&lock, thread_id+1);
-  fprintf(trace,"%d %p: R %p\n", thread_id, ip, addr);
-  fflush(trace);
-  ReleaseLock(&lock);
-}
+  UINT64      executed;
+  UINT64      reported;
+  UINT8       pad[48];
+};
+THREAD_ICOUNT icount[MAX_THREADS];
 
-// Print a memory write record
-VOID PIN_FAST_ANALYSIS_CALL RecordMemWrite(VOID * ip, VOID * addr, THREADID thread_id)
+// One of the analyses replaces the trace files
+BOOL Analyzing()
 {
-  GetLock(&lock, thread_id+1);
-  fprintf(trace,"%d %p: W %p\n", thread_id, ip, addr);
-  fflush(trace);
-  ReleaseLock(&lock);
+    return KnobHeatmap.Value() || KnobSharing.Value() || KnobTlbSim.Value();
 }
 
-// This routine is executed __parsec_roi_begin() is called.
-
-VOID BeforeROI( THREADID threadid )
+// This routine is executed every time a thread is created.
+VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
-    GetLock(&lock, threadid+1);
-    fprintf(trace, "thread %d entered ROI\n", threadid);
-    fflush(trace);
-    ReleaseLock(&lock);
-}
+    if (threadid >= MAX_THREADS)
+    {
+        printf("Error: thread %d not traced, raise MAX_THREADS\n", threadid);
+        return;
+    }
 
-// This routine is executed __parsec_roi_begin() is called.
+    if (Analyzing())
+    {
+        if (KnobHeatmap.Value())
+            heat[threadid] = new PAGE_HEAT_TABLE;
+        if (KnobTlbSim.Value())
+        {
+            GetLock(&tlb_lock, threadid+1);
+            tlb_pending[threadid] = (struct MEMREF *) PIN_GetBufferPointer(ctxt, bufId);
+            ReleaseLock(&tlb_lock);
+        }
+        return;
+    }
 
-VOID AfterROI( THREADID threadid )
-{
-    GetLock(&lock, threadid+1);
-    fprintf(trace, "thread %d exited ROI\n", threadid);
-    fflush(trace);
-    ReleaseLock(&lock);
+    char name[256];
+    snprintf(name, sizeof(name), "%s.%d",
+             KnobOutputFile.Value().c_str(), threadid);
+    // a shared writable mapping needs the file open for reading too
+    trace_fd[threadid] = open(name, (KnobMmap.Value() ? O_RDWR : O_WRONLY)
+                              | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd[threadid] < 0)
+    {
+        printf("Error: could not open %s\n", name);
+        return;
+    }
+    trace_failed[threadid] = FALSE;
+    if (KnobMmap.Value())
+    {
+        trace_out[threadid] = new TRACE_MMAP_OUTPUT;
+        if (!trace_out[threadid]->Open(trace_fd[threadid],
+                                       (UINT64) KnobMmap.Value() << 20,
+                                       (UINT64) KnobMmap.Value() << 22))
+        {
+            // fall back to write()
+            printf("Error: could not map %s\n", name);
+            delete trace_out[threadid];
+            trace_out[threadid] = NULL;
+        }
+    }
+    WriteTrace(threadid, &trace_header, sizeof(trace_header));
 }
 
 /**************************************************************************
@@ -106,23 +228,106 @@ VOID AfterROI( THREADID threadid )
  *
  **************************************************************************/
 
+// Runs on a writer thread: write one full buffer, or a marker, to the
+// trace file of the thread it came from.
+VOID WriteBuffer(const TRACE_WORK *work)
+{
+  if (work->tid >= MAX_THREADS || trace_fd[work->tid] < 0
+      || trace_failed[work->tid])
+    return;
+
+  struct MEMREF * reference=(struct MEMREF*)work->buf;
+  struct MEMREF * out=(struct MEMREF*)work->buf;
+  for(unsigned int i=0; i<work->numElements; i++, reference++)
+    {
+      // markers have pc 0 and the thread id, maybe 0, in ea
+      if (reference->ea != 0 || reference->pc == 0)
+        *out++ = *reference;
+    }
+  WriteTrace(work->tid, work->buf, (char*)out - (char*)work->buf);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL CountInstructions(THREADID tid, UINT32 n)
+{
+  if (tid < MAX_THREADS)
+    icount[tid].executed += n;
+}
+
+// Region holding va; the maps are read again for an unknown one
+const VMA * FindVma(ADDRINT va)
+{
+  int i = PROC_FindVma(tlb_maps, va);
+  if (i < 0)
+    {
+      PROC_ReadMaps(tlb_maps);
+      i = PROC_FindVma(tlb_maps, va);
+    }
+  return i < 0 ? NULL : &tlb_maps[i];
+}
+
+// Run the records [refs, end) through the TLBs, under tlb_lock
+VOID SimulateTlb(THREADID tid, const struct MEMREF *refs, const struct MEMREF *end)
+{
+  tlbs.Instructions(tid, icount[tid].executed - icount[tid].reported);
+  icount[tid].reported = icount[tid].executed;
+  for (; refs < end; refs++)
+    {
+      if (refs->pc == 0 || refs->ea == 0)
+        continue;
+      unsigned shift;
+      translator.Lookup(refs->ea, &shift);
+      tlbs.Access(tid, refs->ea, shift, FindVma(refs->ea), 0);
+    }
+}
+
+// The records buffered so far were made against the mappings the call
+// is about to change: simulate them now.  map_watch holds tlb_lock.
+VOID BeforeMappingCall(THREADID tid, CONTEXT *ctxt, VOID *v)
+{
+  if (tid >= MAX_THREADS || tlb_pending[tid] == NULL)
+    return;
+  struct MEMREF * end = (struct MEMREF *) PIN_GetBufferPointer(ctxt, bufId);
+  if (end < tlb_pending[tid])
+    return;
+  SimulateTlb(tid, tlb_pending[tid], end);
+  tlb_pending[tid] = end;
+}
+
+// Hand the full buffer to a writer thread and keep going with a fresh
+// one, or fold it into the analyses right here
 VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
                   unsigned numElements, VOID *v)
 {
-  struct MEMREF * reference=(struct MEMREF*)buf;
-
-  GetLock(&lock, tid+1);
+  if (!Analyzing())
+    return writers.Submit(tid, buf, numElements);
 
+  if (tid >= MAX_THREADS)
+    return buf;
+  struct MEMREF * reference=(struct MEMREF*)buf;
+  if (KnobTlbSim.Value())
+    {
+      GetLock(&tlb_lock, tid+1);
+      struct MEMREF * from = tlb_pending[tid];
+      if (from < reference || from > reference + numElements)
+        from = reference;
+      SimulateTlb(tid, from, reference + numElements);
+      // the buffer is given back to be filled again from the start
+      tlb_pending[tid] = reference;
+      ReleaseLock(&tlb_lock);
+    }
   for(unsigned int i=0; i<numElements; i++, reference++)
     {
-      if (reference->ea != 0)
-	fprintf(trace,"%ld %ld %d %d\n", reference->pc, reference->ea, 
-		reference->thread_id, reference->read);
+      if (reference->pc == 0 || reference->ea == 0)
+        continue;
+      if (heat[tid] != NULL)
+        heat[tid]->Touch(reference->ea >> page_shift, reference->read,
+                         reference->timestamp);
+      if (KnobSharing.Value())
+        sharing.Reference(sharing_run[tid], tid, reference->ea, reference->size,
+                          reference->read, reference->pc);
     }
-  fflush(trace);
-  ReleaseLock(&lock);
-  //DumpBufferToFile( reference, numElements, tid );
-    
+  if (KnobSharing.Value())
+    sharing.Flush(sharing_run[tid], tid);
   return buf;
 }
 
@@ -133,64 +338,56 @@ VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
 //====================================================================
 //
 
+// ROI markers go through the buffer like the references so that they
+// keep their place, and their timestamp, in the thread's stream
+VOID InsertMarker(RTN rtn, UINT32 kind)
+{
+    INS_InsertFillBuffer(RTN_InsHead(rtn), IPOINT_BEFORE, bufId,
+                         IARG_ADDRINT, (ADDRINT) 0, offsetof(struct MEMREF, pc),
+                         IARG_THREAD_ID, offsetof(struct MEMREF, ea),
+                         IARG_UINT32, kind, offsetof(struct MEMREF, size),
+                         IARG_THREAD_ID, offsetof(struct MEMREF, thread_id),
+                         IARG_BOOL, FALSE, offsetof(struct MEMREF, read),
+                         IARG_TSC, offsetof(struct MEMREF, timestamp),
+                         IARG_END);
+}
+
 // This routine is executed for each image.
 VOID ImageLoad(IMG img, VOID *)
 {
     RTN rtn = RTN_FindByName(img, "__parsec_roi_begin");
     RTN end_rtn = RTN_FindByName(img, "__parsec_roi_end");
 
-    //GetLock(&lock, PIN_ThreadId()+1);
-
     if ( RTN_Valid( rtn ))
     {
-      /*
-      fprintf(trace, "thread %d entered ROI\n", PIN_ThreadId());
-      fflush(trace);
-      */
-        printf("thread %d entered ROI\n", PIN_ThreadId());
-
         RTN_Open(rtn);
-        RTN_InsertCall(rtn, IPOINT_AFTER, AFUNPTR(BeforeROI),
-                       IARG_THREAD_ID, IARG_END);
+        InsertMarker(rtn, TRACE_MARKER_ROI_BEGIN);
         RTN_Close(rtn);
-
     }
 
     if ( RTN_Valid( end_rtn ))
     {
-      /*
-      fprintf(trace, "thread %d exited ROI\n", PIN_ThreadId());
-      fflush(trace);
-      */
-        printf("thread %d exited ROI\n", PIN_ThreadId());
-
         RTN_Open(end_rtn);
-        RTN_InsertCall(end_rtn, IPOINT_AFTER, AFUNPTR(AfterROI),
-                       IARG_THREAD_ID, IARG_END);
+        InsertMarker(end_rtn, TRACE_MARKER_ROI_END);
         RTN_Close(end_rtn);
     }
+}
 
-    //ReleaseLock(&lock);
+// -tlbsim: count the instructions of every basic block
+VOID Trace(TRACE trace, VOID *v)
+{
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    BBL_InsertCall(bbl, IPOINT_BEFORE, AFUNPTR(CountInstructions),
+                   IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID,
+                   IARG_UINT32, BBL_NumIns(bbl), IARG_END);
 }
 
 // Called for every instruction and instruments reads and writes
 VOID Instruction(INS ins, VOID *v)
 {
-    // instruments loads using a predicated call, i.e.
-    // the call happens iff the load will be actually executed
-    // (this does not matter for ia32 but arm and ipf have predicated instructions)
   UINT32 refSize;
     if (INS_IsMemoryRead(ins))
     {
-      /*
-        INS_InsertPredicatedCall(
-	    ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-	    IARG_FAST_ANALYSIS_CALL,
-            IARG_INST_PTR,
-            IARG_MEMORYREAD_EA,
-	    IARG_THREAD_ID,
-            IARG_END);
-      */
       //using fast buffering API
       refSize = INS_MemoryReadSize(ins);
 
@@ -200,25 +397,13 @@ VOID Instruction(INS ins, VOID *v)
 			   IARG_UINT32, refSize, offsetof(struct MEMREF, size),
 			   IARG_THREAD_ID, offsetof(struct MEMREF, thread_id),
 			   IARG_BOOL, TRUE, offsetof(struct MEMREF, read),
+			   IARG_TSC, offsetof(struct MEMREF, timestamp),
 			   IARG_END);
 
     }
 
-    // instruments stores using a predicated call, i.e.
-    // the call happens iff the store will be actually executed
     if (INS_IsMemoryWrite(ins))
     {
-      /*
-      //GetLock(&lock, PIN_ThreadId()+1);
-        INS_InsertPredicatedCall(
-            ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-	    IARG_FAST_ANALYSIS_CALL,
-            IARG_INST_PTR,
-            IARG_MEMORYWRITE_EA,
-	    IARG_THREAD_ID,
-            IARG_END);
-      //ReleaseLock(&lock);
-      */
       //using fast buffering API
       refSize = INS_MemoryWriteSize(ins);
 
@@ -228,34 +413,142 @@ VOID Instruction(INS ins, VOID *v)
 			   IARG_UINT32, refSize, offsetof(struct MEMREF, size),
 			   IARG_THREAD_ID, offsetof(struct MEMREF, thread_id),
 			   IARG_BOOL, FALSE, offsetof(struct MEMREF, read),
+			   IARG_TSC, offsetof(struct MEMREF, timestamp),
 			   IARG_END);
 
     }
 }
 
 
+// Internal threads must be gone before Fini: drain the queues here.
+// Buffers flushed after this are written inline by their thread.
+VOID PrepareForFini(VOID *v)
+{
+    writers.Stop();
+}
+
+// Merge the threads' pages and write the profile
+VOID WriteHeatmap()
+{
+    PAGE_HEAT_TABLE all;
+    UINT32 threads = 0;
+    for (UINT32 i = 0; i < MAX_THREADS; i++)
+    {
+        if (heat[i] == NULL)
+            continue;
+        all.Merge(*heat[i], i);
+        delete heat[i];
+        heat[i] = NULL;
+        threads++;
+    }
+
+    FILE * out = fopen(KnobOutputFile.Value().c_str(), "w");
+    if (out == NULL)
+    {
+        printf("Error: could not open %s\n", KnobOutputFile.Value().c_str());
+        return;
+    }
+    if (!PAGE_HEAT_Write(out, all, threads))
+        printf("Error: could not translate the heatmap\n");
+    fclose(out);
+}
+
+// Routine of a PC, for the sharing report
+const char * SymbolOf(uint64_t pc)
+{
+    static string name;
+    PIN_LockClient();
+    name = RTN_FindNameByAddress(pc);
+    PIN_UnlockClient();
+    return name.empty() ? NULL : name.c_str();
+}
+
+VOID WriteSharing()
+{
+    string path = KnobOutputFile.Value() + ".sharing";
+    FILE * out = fopen(path.c_str(), "w");
+    if (out == NULL)
+    {
+        printf("Error: could not open %s\n", path.c_str());
+        return;
+    }
+    sharing.Print(out, KnobSharingTop.Value(), SymbolOf);
+    fclose(out);
+}
+
+VOID WriteTlb()
+{
+    string path = KnobOutputFile.Value() + ".tlb";
+    FILE * out = fopen(path.c_str(), "w");
+    if (out == NULL)
+    {
+        printf("Error: could not open %s\n", path.c_str());
+        return;
+    }
+    fprintf(out, "# TLB simulation, dtlb 4k %s 2m %s 1g %s, stlb %s, pwc %s\n",
+            KnobDtlb4K.Value().c_str(), KnobDtlb2M.Value().c_str(),
+            KnobDtlb1G.Value().c_str(), KnobStlb.Value().c_str(),
+            KnobPwc.Value().empty() ? "none" : KnobPwc.Value().c_str());
+    tlbs.Print(out);
+    fclose(out);
+}
+
 VOID Fini(INT32 code, VOID *v)
 {
-    //GetLock(&lock, thread_id+1);
-    fflush(trace);
-    fprintf(trace, "#eof\n");
-    fflush(trace);
-    fclose(trace);
-    //ReleaseLock(&lock);
+    writers.Stop();
+    if (KnobHeatmap.Value())
+        WriteHeatmap();
+    if (KnobSharing.Value())
+        WriteSharing();
+    if (KnobTlbSim.Value())
+        WriteTlb();
+    for (UINT32 i = 0; i < MAX_THREADS; i++)
+    {
+        if (trace_out[i] != NULL)
+        {
+            if (!trace_out[i]->Finish())
+                printf("Error: could not finish the mapped trace of thread %u\n", i);
+            delete trace_out[i];
+            trace_out[i] = NULL;
+        }
+        if (trace_fd[i] >= 0)
+            close(trace_fd[i]);
+    }
 }
 
 
 int main(int argc, char *argv[])
 {
-    // Initialize the pin lock
-    InitLock(&lock);
-    
     // Initialize pin
     PIN_InitSymbols();
     PIN_Init(argc, argv);
 
-    // Open the trace file    
-    trace = fopen(KnobOutputFile.Value().c_str(), "w");
+    // The trace files are opened per thread in ThreadStart
+    for (UINT32 i = 0; i < MAX_THREADS; i++)
+    {
+        trace_fd[i] = -1;
+        trace_out[i] = NULL;
+        trace_failed[i] = FALSE;
+        tlb_pending[i] = NULL;
+        heat[i] = NULL;
+    }
+    while ((1UL << page_shift) < (unsigned long) getpagesize())
+        page_shift++;
+
+    TRACE_InitHeader(&trace_header, sizeof(struct MEMREF));
+    trace_header.thread_count = 1;
+    TRACE_SetField(&trace_header, TRACE_FIELD_PC,
+                   offsetof(struct MEMREF, pc), sizeof(ADDRINT));
+    TRACE_SetField(&trace_header, TRACE_FIELD_EA,
+                   offsetof(struct MEMREF, ea), sizeof(ADDRINT));
+    TRACE_SetField(&trace_header, TRACE_FIELD_SIZE,
+                   offsetof(struct MEMREF, size), sizeof(UINT32));
+    TRACE_SetField(&trace_header, TRACE_FIELD_THREAD_ID,
+                   offsetof(struct MEMREF, thread_id), sizeof(UINT32));
+    TRACE_SetField(&trace_header, TRACE_FIELD_READ,
+                   offsetof(struct MEMREF, read), sizeof(BOOL));
+    TRACE_SetField(&trace_header, TRACE_FIELD_TIMESTAMP,
+                   offsetof(struct MEMREF, timestamp), sizeof(UINT64));
 
     // Initialize the memory reference buffer;
     // set up the callback to process the buffer.
@@ -269,6 +562,42 @@ int main(int argc, char *argv[])
         return 1;
       }
 
+    if (KnobSharing.Value())
+        sharing.Init(KnobSharingLines.Value(), 64);
+
+    if (KnobTlbSim.Value())
+      {
+        const string specs[] = { KnobDtlb4K.Value(), KnobDtlb2M.Value(),
+                                 KnobDtlb1G.Value(), KnobStlb.Value(),
+                                 KnobPwc.Value() };
+        CACHE_CONFIG configs[5];
+        for (int k = 0; k < 5; k++)
+          {
+            if (k == 4 && specs[k].empty())
+              break;
+            if (!TLB_ParseConfig(specs[k].c_str(), &configs[k]))
+              {
+                printf("Error: bad TLB %s\n", specs[k].c_str());
+                return 1;
+              }
+          }
+        tlbs.Init(configs, configs[3], specs[4].empty() ? NULL : &configs[4]);
+        if (!translator.Open())
+          return 1;
+        PROC_ReadMaps(tlb_maps);
+        InitLock(&tlb_lock);
+        map_watch.Start(&translator, &tlb_lock, BeforeMappingCall);
+        TRACE_AddInstrumentFunction(Trace, 0);
+      }
+
+    // Spawn the writer threads, not needed for the analyses
+    if (!Analyzing()
+        && !writers.Start(bufId, WriteBuffer, KnobWriters.Value(),
+                          KnobQueueDepth.Value()))
+      {
+        return 1;
+      }
+
 
     // Register Instruction function to be called with each executed inst.
     INS_AddInstrumentFunction(Instruction, 0);
@@ -278,9 +607,10 @@ int main(int argc, char *argv[])
 
     // Register Analysis routines to be called when a thread begins/ends
     PIN_AddThreadStartFunction(ThreadStart, 0);
-    PIN_AddThreadFiniFunction(ThreadFini, 0);
 
-    // Register Fini to be called when the application exits
+    // Register PrepareForFini to stop the writer threads and Fini to be
+    // called when the application exits
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
@@ -1,6 +1,18 @@
 #include <stdio.h>
+#include <fcntl.h>
 #include "pin.H"
 #include "instlib.H"
+#include "trace_format.H"
+#include "trace_codec.H"
+#include "trace_mmap.H"
+#include "sampler.H"
+#include "cache_sim.H"
+#include "tlb_sim.H"
+#include "reuse_distance.H"
+#include "pa_translate.H"
+#include "page_heat.H"
+#include "map_watch.H"
+#include <vector>
 //#include <Python.h>
 
 #define PIN_FAST_ANALYSIS_CALL
@@ -10,18 +22,191 @@ using namespace INSTLIB;
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
     "o", "malloc_mt.out", "specify output file name");
 
+KNOB<BOOL> KnobRoi(KNOB_MODE_WRITEONCE, "pintool",
+    "roi", "0", "trace only between __parsec_roi_begin and __parsec_roi_end "
+    "(0: the whole program)");
+
+KNOB<string> KnobCompress(KNOB_MODE_WRITEONCE, "pintool",
+    "compress", "none", "trace compression: none, delta (delta/varint "
+    "records) or lz (delta, then LZ per buffer)");
+
+KNOB<UINT32> KnobMmap(KNOB_MODE_WRITEONCE, "pintool",
+    "mmap", "0", "write the trace through a mapped window of that many MB "
+    "of the file, preallocated, instead of write() (0: write())");
+
+KNOB<BOOL> KnobCacheSim(KNOB_MODE_WRITEONCE, "pintool",
+    "cachesim", "0", "simulate the caches online instead of writing a "
+    "trace; the statistics go to the -o file");
+
+KNOB<string> KnobL1(KNOB_MODE_WRITEONCE, "pintool",
+    "l1", "32k:8:64:lru", "L1 <size>:<assoc>:<line size>:<lru|fifo|random>, "
+    "empty for none");
+
+KNOB<string> KnobL2(KNOB_MODE_WRITEONCE, "pintool",
+    "l2", "256k:8:64:lru", "L2, same format as -l1");
+
+KNOB<string> KnobLLC(KNOB_MODE_WRITEONCE, "pintool",
+    "llc", "8m:16:64:lru", "last level cache, same format as -l1");
+
+KNOB<string> KnobCacheIndex(KNOB_MODE_WRITEONCE, "pintool",
+    "cache_index", "virtual", "index the caches with virtual or physical "
+    "addresses");
+
+KNOB<UINT32> KnobCachePcs(KNOB_MODE_WRITEONCE, "pintool",
+    "cache_pcs", "100", "pcs reported, by misses in the last level "
+    "(0: no per pc statistics)");
+
+KNOB<BOOL> KnobTlbSim(KNOB_MODE_WRITEONCE, "pintool",
+    "tlbsim", "0", "simulate the TLBs online instead of writing a trace; "
+    "the statistics go to the -o file");
+
+KNOB<string> KnobDtlb4K(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_4k", "64:4", "L1 dTLB for 4 KB pages, <entries>:<assoc>");
+
+KNOB<string> KnobDtlb2M(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_2m", "32:4", "L1 dTLB for 2 MB pages");
+
+KNOB<string> KnobDtlb1G(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_1g", "4:4", "L1 dTLB for 1 GB pages");
+
+KNOB<string> KnobStlb(KNOB_MODE_WRITEONCE, "pintool",
+    "stlb", "1536:12", "second level TLB for 4 KB and 2 MB pages");
+
+KNOB<string> KnobPwc(KNOB_MODE_WRITEONCE, "pintool",
+    "pwc", "", "page walk caches, one per upper level, e.g. 32:4 "
+    "(empty: none)");
+
+KNOB<BOOL> KnobReuse(KNOB_MODE_WRITEONCE, "pintool",
+    "reuse", "0", "compute reuse distance histograms and miss ratio curves "
+    "of lines, pages and frames instead of writing a trace; they go to "
+    "the -o file");
+
+KNOB<BOOL> KnobHeatmap(KNOB_MODE_WRITEONCE, "pintool",
+    "heatmap", "0", "write a per-page profile (reads, writes, first and "
+    "last touch in instructions, threads, frame, region) to the -o file "
+    "instead of a trace");
+
+KNOB<UINT32> KnobReuseSample(KNOB_MODE_WRITEONCE, "pintool",
+    "reuse_sample", "1", "track 1 in N lines/pages/frames (SHARDS), 1: all");
+
+KNOB<string> KnobSample(KNOB_MODE_WRITEONCE, "pintool",
+    "sample", "none", "sampling: none, periodic (trace -sample_len "
+    "instructions, skip -sample_skip), random (trace each -sample_len "
+    "interval with -sample_rate % probability) or thread (random, drawn "
+    "per thread)");
+
+KNOB<UINT64> KnobSampleLen(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_len", "1000000", "instructions in a traced interval");
+
+KNOB<UINT64> KnobSampleSkip(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_skip", "9000000", "instructions skipped between periodic "
+    "intervals");
+
+KNOB<UINT32> KnobSampleRate(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_rate", "10", "percentage of the intervals traced by random "
+    "sampling");
+
+KNOB<UINT32> KnobSampleSeed(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_seed", "1", "seed of random sampling");
+
 /*
  * The ID of the buffer
  */
 BUFFER_ID bufId;
 
+/*
+ * Inside the region of interest.  Outside it Trace() inserts no
+ * instrumentation at all and the application runs from a plain code
+ * cache; every ROI transition flushes the code cache so that the code
+ * is JITted again with or without the memory instrumentation.
+ */
 BOOL ENABLE_LOGGING = TRUE;
 
+// -roi: some image has __parsec_roi_begin
+BOOL roi_found = FALSE;
+
+/*
+ * The output trace file, in the binary format of trace_format.H.
+ * Each record is a MEMREF:
+ * <IP> <EA> <SIZE> <R/W> <# inst executed b/w this and prev. memory inst.>
+ * Use trace2text to get the text version.
+ */
+int trace_fd;
+TRACE_HEADER trace_header;
+
+/*
+ * -mmap: the trace file is filled through a window mapped from it, under
+ * lock
+ */
+TRACE_MMAP_OUTPUT trace_out;
+
+/*
+ * Set once a write to the trace failed (no space left, say): tracing
+ * stops there rather than go on with a hole in the trace
+ */
+BOOL trace_failed = FALSE;
+
+/*
+ * Number of application threads seen, recorded in the header at Fini
+ */
+UINT32 num_threads = 0;
+
+/*
+ * Compressed output: per thread delta state and the scratch buffers
+ * a flush is encoded into.  lock guards them.
+ */
+std::vector<TRACE_CODEC_STATE> codec_state;
+std::vector<UINT8> encode_buf;
+std::vector<UINT8> lz_buf;
+PIN_LOCK lock;
+
+/*
+ * Online cache simulation (-cachesim): the buffers go to the model
+ * instead of the trace, under lock.  Physical indexing translates
+ * with the tool's own pagemap reader; references to pages that are
+ * not present are left out and counted.
+ */
+CACHE_HIERARCHY caches;
+PA_TRANSLATOR translator;
+MAP_WATCH map_watch;
+BOOL physical_index = FALSE;
+UINT64 untranslated = 0;
+
+/*
+ * Per thread, the first record of its buffer not simulated yet: the
+ * ones before it went through the models at the entry of a mapping
+ * call, while their translations were still right.  Under lock.
+ */
+TLS_KEY pending_key;
+
+/*
+ * Online TLB simulation (-tlbsim), also under lock.  The page size of
+ * a reference comes from the translator, its region from our copy of
+ * /proc/self/maps.  last_pc tells the second operand of an instruction
+ * from a new instruction when counting instructions.
+ */
+TLB_SIM tlbs;
+std::vector<VMA> tlb_maps;
+std::vector<ADDRINT> last_pc;
+
 /*
- * The output trace file format
- * <IP> <EA> <SIZE> <R/W> 
+ * Online reuse distances (-reuse), also under lock
  */
-FILE * trace;
+REUSE_PROFILE reuse;
+
+/*
+ * Per-page profile (-heatmap), one table per thread, also under lock.
+ * Time is the thread's instruction count.
+ */
+std::vector<PAGE_HEAT_TABLE *> heat;
+std::vector<UINT64> heat_icount;
+
+// One of the online models replaces the trace file
+BOOL Simulating()
+{
+    return KnobCacheSim.Value() || KnobTlbSim.Value() || KnobReuse.Value()
+        || KnobHeatmap.Value();
+}
 
 /*
  * Number of OS pages for the buffer
@@ -39,27 +224,248 @@ struct MEMREF
   ADDRINT     ea;
   UINT32      size;
   BOOL        read;
+  ADDRINT     icount;
 };
 
+/*
+ * Non-memory instructions are not recorded.  The number of them
+ * executed between two memory references is known statically inside a
+ * basic block; what a block executes after its last memory reference
+ * is carried over to the next block in this tool register, one per
+ * thread, and added to the first record there.  A predicated memory
+ * instruction (CMOVcc, REP string ops) may not run: it and the record
+ * after it go through the register too, and when it is predicated off
+ * it is counted there instead of recorded.
+ */
+REG gap_reg;
+
+/*
+ * Sampling.  sample_reg points to the thread's SAMPLE_THREAD; skipped
+ * intervals only run the per block count and an inline test in front
+ * of each fill.  Every traced segment starts with a segment marker.
+ */
+SAMPLER sampler;
+REG sample_reg;
+TLS_KEY sample_key;
+
 /*
  *==============================================================
  *  Analysis Routines
  *==============================================================
  */
-// This routine is executed when __parsec_roi_begin() is called.
-VOID BeforeROI( THREADID threadid )
+// Region holding va; the maps are read again for an unknown one
+const VMA * FindVma( ADDRINT va )
+{
+    int i = PROC_FindVma(tlb_maps, va);
+    if (i < 0)
+    {
+        PROC_ReadMaps(tlb_maps);
+        i = PROC_FindVma(tlb_maps, va);
+    }
+    return i < 0 ? NULL : &tlb_maps[i];
+}
+
+// Run records through the online models, under lock; markers only
+// delimit ROIs
+VOID SimulateRecords( THREADID tid, struct MEMREF *refs, UINT32 n )
+{
+    if (tid >= last_pc.size())
+        last_pc.resize(tid + 1, 0);
+    for (UINT32 i = 0; i < n; i++)
+    {
+        if (refs[i].pc == 0)
+        {
+            if (KnobReuse.Value() && (refs[i].size == TRACE_MARKER_ROI_BEGIN
+                                      || refs[i].size == TRACE_MARKER_ROI_END))
+                reuse.Roi(tid, refs[i].size == TRACE_MARKER_ROI_BEGIN);
+            continue;
+        }
+
+        if (KnobReuse.Value())
+            reuse.Access(tid, refs[i].ea, translator.Translate(refs[i].ea));
+
+        if (KnobHeatmap.Value())
+        {
+            if (tid >= heat.size())
+            {
+                heat.resize(tid + 1, NULL);
+                heat_icount.resize(tid + 1, 0);
+            }
+            if (heat[tid] == NULL)
+                heat[tid] = new PAGE_HEAT_TABLE;
+            heat_icount[tid] += refs[i].icount;
+            heat[tid]->Touch(refs[i].ea >> translator.PageShift(), refs[i].read,
+                             heat_icount[tid]);
+        }
+
+        if (KnobTlbSim.Value())
+        {
+            unsigned shift;
+            translator.Lookup(refs[i].ea, &shift);
+            UINT64 insts = refs[i].icount;
+            if (refs[i].icount != 0 || refs[i].pc != last_pc[tid])
+                insts++;
+            last_pc[tid] = refs[i].pc;
+            tlbs.Access(tid, refs[i].ea, shift, FindVma(refs[i].ea), insts);
+        }
+        if (!KnobCacheSim.Value())
+            continue;
+
+        UINT64 addr = refs[i].ea;
+        if (physical_index && (addr = translator.Translate(addr)) == 0)
+        {
+            untranslated++;
+            continue;
+        }
+        caches.Access(tid, refs[i].pc, addr, refs[i].size);
+    }
+}
+
+// The records buffered so far were made against the mappings the call
+// is about to change: simulate them now.  map_watch holds lock.
+VOID BeforeMappingCall( THREADID tid, CONTEXT *ctxt, VOID *v )
+{
+    struct MEMREF * from = (struct MEMREF *) PIN_GetThreadData(pending_key, tid);
+    struct MEMREF * end = (struct MEMREF *) PIN_GetBufferPointer(ctxt, bufId);
+    if (from == NULL || end < from)
+        return;
+    SimulateRecords(tid, from, end - from);
+    PIN_SetThreadData(pending_key, end, tid);
+}
+
+// Append to the trace file; the mapped window needs the lock
+VOID WriteTrace( const VOID *buf, size_t len )
+{
+    if (trace_failed)
+        return;
+    bool written = KnobMmap.Value() ? trace_out.Write(buf, len)
+        : TRACE_WriteAll(trace_fd, buf, len);
+    if (!written)
+    {
+        printf("Error: could not write %s, tracing stops\n",
+               KnobOutputFile.Value().c_str());
+        trace_failed = TRUE;
+    }
+}
+
+// Write records to the trace, as they are or as one compressed chunk
+VOID WriteRecords( THREADID tid, struct MEMREF *refs, UINT32 n )
+{
+    if (Simulating())
+    {
+        GetLock(&lock, tid+1);
+        SimulateRecords(tid, refs, n);
+        ReleaseLock(&lock);
+        return;
+    }
+    if (trace_failed)
+        return;
+    if (trace_header.encoding == TRACE_ENCODING_RAW)
+    {
+        if (!KnobMmap.Value())
+        {
+            WriteTrace(refs, n * sizeof(struct MEMREF));
+            return;
+        }
+        GetLock(&lock, tid+1);
+        WriteTrace(refs, n * sizeof(struct MEMREF));
+        ReleaseLock(&lock);
+        return;
+    }
+    if (n == 0)
+        return;
+
+    GetLock(&lock, tid+1);
+    if (tid >= codec_state.size())
+    {
+        TRACE_CODEC_STATE zero;
+        memset(&zero, 0, sizeof(zero));
+        codec_state.resize(tid + 1, zero);
+    }
+
+    // leave room for the chunk header in front of the payload
+    size_t bound = sizeof(TRACE_CHUNK) + TRACE_MaxEncodedSize(&trace_header, n);
+    if (encode_buf.size() < bound)
+        encode_buf.resize(bound);
+    TRACE_CHUNK chunk;
+    chunk.tid = tid;
+    chunk.records = n;
+    chunk.encoded_len = TRACE_EncodeRecords(&trace_header, (const char*)refs, n,
+                                            &codec_state[tid],
+                                            &encode_buf[sizeof(chunk)]);
+    chunk.stored_len = chunk.encoded_len;
+    UINT8 * out = &encode_buf[0];
+
+    if (trace_header.encoding == TRACE_ENCODING_DELTA_LZ)
+    {
+        bound = sizeof(TRACE_CHUNK) + TRACE_LzBound(chunk.encoded_len);
+        if (lz_buf.size() < bound)
+            lz_buf.resize(bound);
+        size_t len = TRACE_LzCompress(&encode_buf[sizeof(chunk)], chunk.encoded_len,
+                                      &lz_buf[sizeof(chunk)]);
+        // keep the delta stream when LZ does not pay off
+        if (len < chunk.encoded_len)
+        {
+            chunk.stored_len = len;
+            out = &lz_buf[0];
+        }
+    }
+    memcpy(out, &chunk, sizeof(chunk));
+    WriteTrace(out, sizeof(chunk) + chunk.stored_len);
+    ReleaseLock(&lock);
+}
+
+// Write a segment marker straight to the trace
+VOID WriteSegment( THREADID threadid, UINT64 offset )
+{
+    struct MEMREF marker;
+    memset(&marker, 0, sizeof(marker));
+    marker.ea = threadid;
+    marker.size = TRACE_MARKER_SEGMENT;
+    marker.icount = offset;
+    WriteRecords(threadid, &marker, 1);
+}
+
+// Count down the instructions of a block, TRUE when the quantum is over
+ADDRINT SampleCount(SAMPLE_THREAD *t, UINT32 n)
 {
-    fprintf(trace, "thread %d entered ROI\n", threadid);
-    fflush(trace);
-    ENABLE_LOGGING = TRUE;
+    t->left -= n;
+    return t->left <= 0;
+}
+
+// Move on to the next quantum; remember where a traced segment starts
+VOID SampleAdvance(SAMPLE_THREAD *t, UINT32 n, CONTEXT *ctxt)
+{
+    if (sampler.Advance(t))
+        t->starts.push_back(std::make_pair(
+            (ADDRINT) PIN_GetBufferPointer(ctxt, bufId), t->executed - n));
+}
+
+ADDRINT IsSampled(SAMPLE_THREAD *t)
+{
+    return t->on;
 }
 
 // This routine is executed when __parsec_roi_begin() is called.
+// The instruction gap of the thread restarts with the region.
+ADDRINT BeforeROI( THREADID threadid )
+{
+    if (!ENABLE_LOGGING)
+    {
+        ENABLE_LOGGING = TRUE;
+        PIN_RemoveInstrumentation();
+    }
+    return 0;
+}
+
+// This routine is executed when __parsec_roi_end() is called.
 VOID AfterROI( THREADID threadid )
 {
-    fprintf(trace, "thread %d exited ROI\n#eof\n", threadid);
-    fflush(trace);
-    ENABLE_LOGGING = FALSE;
+    if (ENABLE_LOGGING)
+    {
+        ENABLE_LOGGING = FALSE;
+        PIN_RemoveInstrumentation();
+    }
 }
 
 /*
@@ -69,21 +475,95 @@ VOID AfterROI( THREADID threadid )
  *
  **************************************************************************
  */
+// Count instructions that have no record yet
+ADDRINT AddGap(ADDRINT pending, ADDRINT n)
+{
+  return pending + n;
+}
+
+// The same for a REP string op, whose later iterations add nothing
+ADDRINT AddRepGap(ADDRINT pending, ADDRINT n, BOOL first)
+{
+  return first ? pending + n : pending;
+}
+
+// The pending count went into a record, unless the instruction was
+// predicated off: then it is one more instruction without a record
+ADDRINT ClearGap(ADDRINT pending, BOOL executing)
+{
+  return executing ? 0 : pending + 1;
+}
+
+VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+  num_threads++;
+  PIN_SetContextReg(ctxt, gap_reg, 0);
+  if (Simulating())
+    {
+      GetLock(&lock, threadid+1);
+      PIN_SetThreadData(pending_key, PIN_GetBufferPointer(ctxt, bufId), threadid);
+      ReleaseLock(&lock);
+    }
+
+  if (sampler.Enabled())
+    {
+      SAMPLE_THREAD * t = new SAMPLE_THREAD;
+      sampler.Start(t, threadid);
+      PIN_SetThreadData(sample_key, t, threadid);
+      PIN_SetContextReg(ctxt, sample_reg, (ADDRINT) t);
+    }
+}
+
+VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+  delete (SAMPLE_THREAD *) PIN_GetThreadData(sample_key, threadid);
+  PIN_SetThreadData(sample_key, 0, threadid);
+}
+
+/*
+ * Every record in the buffer is a memory reference or a marker: write
+ * them all with a single write(), compressed if asked to.  With
+ * sampling, the markers of the segments started in this buffer go in
+ * between.
+ */
 VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
                   unsigned numElements, VOID *v)
 {
-  struct MEMREF * reference=(struct MEMREF*)buf;
-  printf("dumping buffer to file\n");
-  for(unsigned int i=0; i<numElements; i++, reference++)
+  struct MEMREF * refs = (struct MEMREF*)buf;
+  unsigned done = 0;
+
+  if (Simulating())
     {
-      if (reference->pc != 0){
-	fprintf(trace,"%lld %lld %d %d \n",
-		(long long int) reference->pc, 
-		(long long int) reference->ea,
-		reference->size, reference->read);
-      }
+      // segment markers mean nothing to the models
+      SAMPLE_THREAD * t = sampler.Enabled()
+        ? (SAMPLE_THREAD *) PIN_GetThreadData(sample_key, tid) : NULL;
+      if (t != NULL)
+        t->starts.clear();
+      GetLock(&lock, tid+1);
+      struct MEMREF * from = (struct MEMREF *) PIN_GetThreadData(pending_key, tid);
+      if (from < refs || from > refs + numElements)
+        from = refs;
+      SimulateRecords(tid, from, refs + numElements - from);
+      // the buffer is given back to be filled again from the start
+      PIN_SetThreadData(pending_key, refs, tid);
+      ReleaseLock(&lock);
+      return buf;
+    }
+
+  if (sampler.Enabled())
+    {
+      SAMPLE_THREAD * t = (SAMPLE_THREAD *) PIN_GetThreadData(sample_key, tid);
+      for (size_t i = 0; t != NULL && i < t->starts.size(); i++)
+        {
+          unsigned at = (t->starts[i].first - (ADDRINT) buf) / sizeof(struct MEMREF);
+          WriteRecords(tid, refs + done, at - done);
+          WriteSegment(tid, t->starts[i].second);
+          done = at;
+        }
+      if (t != NULL)
+        t->starts.clear();
     }
-  fflush(trace);
+  WriteRecords(tid, refs + done, numElements - done);
   return buf;
 }
 
@@ -92,6 +572,21 @@ VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
  * Instrumentation Routines
  *====================================================================
  */
+/*
+ * The ROI marker (pc == 0) goes through the thread's buffer, so it
+ * lands in the trace in order with the thread's own records
+ */
+VOID InsertMarker(RTN rtn, UINT32 kind)
+{
+    INS_InsertFillBuffer(RTN_InsHead(rtn), IPOINT_BEFORE, bufId,
+                         IARG_ADDRINT, (ADDRINT) 0, offsetof(struct MEMREF, pc),
+                         IARG_THREAD_ID, offsetof(struct MEMREF, ea),
+                         IARG_UINT32, kind, offsetof(struct MEMREF, size),
+                         IARG_BOOL, FALSE, offsetof(struct MEMREF, read),
+                         IARG_ADDRINT, (ADDRINT) 0, offsetof(struct MEMREF, icount),
+                         IARG_END);
+}
+
 // This routine is executed for each image.
 VOID ImageLoad(IMG img, VOID *)
 {
@@ -100,9 +595,11 @@ VOID ImageLoad(IMG img, VOID *)
 
     if ( RTN_Valid( rtn ))
     {
+        roi_found = TRUE;
         RTN_Open(rtn);
-        RTN_InsertCall(rtn, IPOINT_AFTER, AFUNPTR(BeforeROI),
-                       IARG_THREAD_ID, IARG_END);
+        InsertMarker(rtn, TRACE_MARKER_ROI_BEGIN);
+        RTN_InsertCall(rtn, IPOINT_BEFORE, AFUNPTR(BeforeROI),
+                       IARG_THREAD_ID, IARG_RETURN_REGS, gap_reg, IARG_END);
         RTN_Close(rtn);
 
     }
@@ -110,72 +607,194 @@ VOID ImageLoad(IMG img, VOID *)
     if ( RTN_Valid( end_rtn ))
     {
         RTN_Open(end_rtn);
-        RTN_InsertCall(end_rtn, IPOINT_AFTER, AFUNPTR(AfterROI),
+        InsertMarker(end_rtn, TRACE_MARKER_ROI_END);
+        RTN_InsertCall(end_rtn, IPOINT_BEFORE, AFUNPTR(AfterROI),
                        IARG_THREAD_ID, IARG_END);
         RTN_Close(end_rtn);
     }
 }
 
 /*
- * Called for every instruction and instruments reads and writes
+ * Record one memory reference of ins.  The instruction gap comes from
+ * gap_reg (fromReg) or is the static gap.
  */
-VOID Instruction(INS ins, VOID *v)
+VOID InsertFill(INS ins, IARG_TYPE eaArg, UINT32 refSize, BOOL read,
+                BOOL fromReg, UINT32 gap)
 {
+  VOID (*fill)(INS, IPOINT, BUFFER_ID, ...) = INS_InsertFillBufferPredicated;
+  if (sampler.Enabled())
+    {
+      INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, AFUNPTR(IsSampled),
+                                 IARG_REG_VALUE, sample_reg, IARG_END);
+      fill = INS_InsertFillBufferThen;
+    }
 
-  if(INS_Valid(ins) )
-  {
+  if (fromReg)
+    fill(ins, IPOINT_BEFORE, bufId,
+			 IARG_INST_PTR, offsetof(struct MEMREF, pc),
+			 eaArg, offsetof(struct MEMREF, ea),
+			 IARG_UINT32, refSize, offsetof(struct MEMREF, size),
+			 IARG_BOOL, read, offsetof(struct MEMREF, read),
+			 IARG_REG_VALUE, gap_reg, offsetof(struct MEMREF, icount),
+			 IARG_END);
+  else
+    fill(ins, IPOINT_BEFORE, bufId,
+			 IARG_INST_PTR, offsetof(struct MEMREF, pc),
+			 eaArg, offsetof(struct MEMREF, ea),
+			 IARG_UINT32, refSize, offsetof(struct MEMREF, size),
+			 IARG_BOOL, read, offsetof(struct MEMREF, read),
+			 IARG_ADDRINT, (ADDRINT) gap, offsetof(struct MEMREF, icount),
+			 IARG_END);
+}
 
-    UINT32 refSize;
+/*
+ * Instruments the reads and writes of ins.  Only its first record
+ * carries the gap; a second operand of the same instruction gets 0.
+ * With fromReg the gap goes through gap_reg: the static part is added
+ * whether or not ins runs (on the first iteration of a REP), and
+ * ClearGap settles the register once the fills are done.
+ */
+VOID InstrumentMemory(INS ins, BOOL fromReg, UINT32 gap)
+{
+  if (fromReg && gap > 0)
+    {
+      if (INS_HasRealRep(ins))
+        INS_InsertCall(ins, IPOINT_BEFORE, AFUNPTR(AddRepGap),
+                       IARG_REG_VALUE, gap_reg, IARG_ADDRINT, (ADDRINT) gap,
+                       IARG_FIRST_REP_ITERATION, IARG_RETURN_REGS, gap_reg, IARG_END);
+      else
+        INS_InsertCall(ins, IPOINT_BEFORE, AFUNPTR(AddGap),
+                       IARG_REG_VALUE, gap_reg, IARG_ADDRINT, (ADDRINT) gap,
+                       IARG_RETURN_REGS, gap_reg, IARG_END);
+    }
 
-    if (INS_IsMemoryRead(ins))
+  BOOL first = fromReg;
+  if (INS_IsMemoryRead(ins))
     {
-      refSize = INS_MemoryReadSize(ins);
-      INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, bufId,
-			   IARG_INST_PTR, offsetof(struct MEMREF, pc),
-			   IARG_MEMORYREAD_EA, offsetof(struct MEMREF, ea),
-			   IARG_UINT32, refSize, offsetof(struct MEMREF, size),
-			   IARG_BOOL, TRUE, offsetof(struct MEMREF, read),
-			   IARG_END);
+      InsertFill(ins, IARG_MEMORYREAD_EA, INS_MemoryReadSize(ins), TRUE, first, gap);
+      first = FALSE;
+      gap = 0;
     }
-    if (INS_HasMemoryRead2(ins))
+  if (INS_HasMemoryRead2(ins))
     {
-      refSize = INS_MemoryReadSize(ins);
-      INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, bufId,
-			   IARG_INST_PTR, offsetof(struct MEMREF, pc),
-			   IARG_MEMORYREAD2_EA, offsetof(struct MEMREF, ea),
-			   IARG_UINT32, refSize, offsetof(struct MEMREF, size),
-			   IARG_BOOL, TRUE, offsetof(struct MEMREF, read), 
-			   IARG_END);
+      InsertFill(ins, IARG_MEMORYREAD2_EA, INS_MemoryReadSize(ins), TRUE, first, gap);
+      first = FALSE;
+      gap = 0;
     }
-    if (INS_IsMemoryWrite(ins))
+  if (INS_IsMemoryWrite(ins))
     {
-      refSize = INS_MemoryWriteSize(ins);
-      INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, bufId,
-			   IARG_INST_PTR, offsetof(struct MEMREF, pc),
-			   IARG_MEMORYWRITE_EA, offsetof(struct MEMREF, ea),
-			   IARG_UINT32, refSize, offsetof(struct MEMREF, size),
-			   IARG_BOOL, FALSE, offsetof(struct MEMREF, read),
-			   IARG_END);
+      InsertFill(ins, IARG_MEMORYWRITE_EA, INS_MemoryWriteSize(ins), FALSE, first, gap);
     }
-    else
+
+  if (fromReg)
+    INS_InsertCall(ins, IPOINT_BEFORE, AFUNPTR(ClearGap),
+                   IARG_REG_VALUE, gap_reg, IARG_EXECUTING,
+                   IARG_RETURN_REGS, gap_reg, IARG_END);
+}
+
+/*
+ * Called for every trace: walks its basic blocks, records the memory
+ * references and counts the other instructions statically
+ */
+VOID Trace(TRACE trace, VOID *v)
+{
+  if (!ENABLE_LOGGING)
+    return;
+
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
     {
-      INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, bufId,
-			   IARG_INST_PTR, offsetof(struct MEMREF, pc),
-			   IARG_PTR, 0, offsetof(struct MEMREF, ea),
-			   IARG_UINT32, 0, offsetof(struct MEMREF, size),
-			   IARG_BOOL, FALSE, offsetof(struct MEMREF, read),
-			   IARG_END);
+      UINT32 gap = 0;
+      BOOL first = TRUE;
+
+      if (sampler.Enabled())
+        {
+          INS_InsertIfCall(BBL_InsHead(bbl), IPOINT_BEFORE, AFUNPTR(SampleCount),
+                           IARG_REG_VALUE, sample_reg,
+                           IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+          INS_InsertThenCall(BBL_InsHead(bbl), IPOINT_BEFORE, AFUNPTR(SampleAdvance),
+                             IARG_REG_VALUE, sample_reg,
+                             IARG_UINT32, BBL_NumIns(bbl), IARG_CONTEXT, IARG_END);
+        }
+      for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        {
+          if (!INS_IsMemoryRead(ins) && !INS_IsMemoryWrite(ins))
+            {
+              gap++;
+              continue;
+            }
+          // a predicated reference may not happen: then it and its
+          // gap have to reach the next record through gap_reg
+          BOOL predicated = INS_IsPredicated(ins) || INS_HasRealRep(ins);
+          InstrumentMemory(ins, first || predicated, gap);
+          first = predicated;
+          gap = 0;
+        }
+
+      // instructions after the last reference count towards the next one
+      if (gap > 0)
+        INS_InsertCall(BBL_InsTail(bbl), IPOINT_BEFORE, AFUNPTR(AddGap),
+                       IARG_REG_VALUE, gap_reg, IARG_ADDRINT, (ADDRINT) gap,
+                       IARG_RETURN_REGS, gap_reg, IARG_END);
     }
-  }
 }
 
 
 VOID Fini(INT32 code, VOID *v)
 {
-    fflush(trace);
-    fprintf(trace, "#eof\n");
-    fflush(trace);
-    fclose(trace);
+    if (KnobRoi.Value() && !roi_found)
+        printf("Warning: -roi 1 but no __parsec_roi_begin in the program, "
+               "nothing was traced\n");
+
+    if (Simulating())
+    {
+        FILE * out = fopen(KnobOutputFile.Value().c_str(), "w");
+        if (out == NULL)
+        {
+            printf("Error: could not open %s\n", KnobOutputFile.Value().c_str());
+            return;
+        }
+        if (KnobTlbSim.Value())
+        {
+            fprintf(out, "# TLB simulation, dtlb 4k %s 2m %s 1g %s, stlb %s, "
+                    "pwc %s, %u threads\n", KnobDtlb4K.Value().c_str(),
+                    KnobDtlb2M.Value().c_str(), KnobDtlb1G.Value().c_str(),
+                    KnobStlb.Value().c_str(),
+                    KnobPwc.Value().empty() ? "none" : KnobPwc.Value().c_str(),
+                    num_threads);
+            tlbs.Print(out);
+        }
+        if (KnobCacheSim.Value())
+        {
+            fprintf(out, "# cache simulation, %s indexing, %u threads\n",
+                    physical_index ? "physical" : "virtual", num_threads);
+            if (physical_index)
+                fprintf(out, "# %llu references to absent pages left out\n",
+                        (unsigned long long) untranslated);
+            caches.Print(out, KnobCachePcs.Value());
+        }
+        if (KnobReuse.Value())
+            reuse.Print(out);
+        if (KnobHeatmap.Value())
+        {
+            PAGE_HEAT_TABLE all;
+            for (UINT32 t = 0; t < heat.size(); t++)
+                if (heat[t] != NULL)
+                    all.Merge(*heat[t], t);
+            PAGE_HEAT_Write(out, all, num_threads);
+        }
+        fclose(out);
+        return;
+    }
+
+    if (KnobMmap.Value() && !trace_out.Finish())
+        printf("Error: could not finish the mapped trace\n");
+
+    // the thread count is only known now
+    trace_header.thread_count = num_threads;
+    if (pwrite(trace_fd, &trace_header, sizeof(trace_header), 0)
+        != sizeof(trace_header))
+        printf("Error: could not update the trace header\n");
+    close(trace_fd);
 }
 
 
@@ -185,10 +804,115 @@ int main(int argc, char *argv[])
     PIN_InitSymbols();
     PIN_Init(argc, argv);
 
-    printf("opening the trace file\n");
-    trace = fopen(KnobOutputFile.Value().c_str(), "w");// error check here!!
+    if (KnobCacheSim.Value())
+      {
+        const char * names[] = { "L1", "L2", "LLC" };
+        const string specs[] = { KnobL1.Value(), KnobL2.Value(), KnobLLC.Value() };
+        for (int l = 0; l < 3; l++)
+          {
+            CACHE_CONFIG config;
+            if (specs[l].empty())
+              continue;
+            if (!CACHE_ParseConfig(specs[l].c_str(), &config))
+              {
+                printf("Error: bad %s cache %s\n", names[l], specs[l].c_str());
+                return 1;
+              }
+            caches.AddLevel(names[l], config);
+          }
+        caches.KeepPerPc(KnobCachePcs.Value() > 0);
+
+        physical_index = KnobCacheIndex.Value() == "physical";
+        if (!physical_index && KnobCacheIndex.Value() != "virtual")
+          {
+            printf("Error: unknown -cache_index %s\n", KnobCacheIndex.Value().c_str());
+            return 1;
+          }
+      }
+    if (KnobTlbSim.Value())
+      {
+        const string specs[] = { KnobDtlb4K.Value(), KnobDtlb2M.Value(),
+                                 KnobDtlb1G.Value(), KnobStlb.Value(),
+                                 KnobPwc.Value() };
+        CACHE_CONFIG configs[5];
+        for (int k = 0; k < 5; k++)
+          {
+            if (k == 4 && specs[k].empty())
+              break;
+            if (!TLB_ParseConfig(specs[k].c_str(), &configs[k]))
+              {
+                printf("Error: bad TLB %s\n", specs[k].c_str());
+                return 1;
+              }
+          }
+        tlbs.Init(configs, configs[3], specs[4].empty() ? NULL : &configs[4]);
+        PROC_ReadMaps(tlb_maps);
+      }
+    if (physical_index || KnobTlbSim.Value() || KnobReuse.Value())
+      {
+        if (!translator.Open())
+          return 1;
+        // invalidate what mapping calls change, after simulating what
+        // the calling thread buffered before
+        map_watch.Start(&translator, &lock, BeforeMappingCall);
+      }
+    pending_key = PIN_CreateThreadDataKey(0);
+    if (KnobReuse.Value())
+      reuse.Init(KnobReuseSample.Value(), 6, translator.PageShift());
+
+    if (!Simulating())
+      {
+        // a shared writable mapping needs the file open for reading too
+        trace_fd = open(KnobOutputFile.Value().c_str(),
+                        (KnobMmap.Value() ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC,
+                        0644);
+        if(trace_fd < 0)
+          {
+            printf("Error: could not open %s\n", KnobOutputFile.Value().c_str());
+            return 1;
+          }
+        if (KnobMmap.Value()
+            && !trace_out.Open(trace_fd, (UINT64) KnobMmap.Value() << 20,
+                               (UINT64) KnobMmap.Value() << 22))
+          {
+            printf("Error: could not map %s\n", KnobOutputFile.Value().c_str());
+            return 1;
+          }
+      }
 
-    printf("opened the trace file\n");
+    TRACE_InitHeader(&trace_header, sizeof(struct MEMREF));
+    TRACE_SetField(&trace_header, TRACE_FIELD_PC,
+                   offsetof(struct MEMREF, pc), sizeof(ADDRINT));
+    TRACE_SetField(&trace_header, TRACE_FIELD_EA,
+                   offsetof(struct MEMREF, ea), sizeof(ADDRINT));
+    TRACE_SetField(&trace_header, TRACE_FIELD_SIZE,
+                   offsetof(struct MEMREF, size), sizeof(UINT32));
+    TRACE_SetField(&trace_header, TRACE_FIELD_READ,
+                   offsetof(struct MEMREF, read), sizeof(BOOL));
+    TRACE_SetField(&trace_header, TRACE_FIELD_ICOUNT,
+                   offsetof(struct MEMREF, icount), sizeof(ADDRINT));
+
+    if (KnobCompress.Value() == "delta")
+        trace_header.encoding = TRACE_ENCODING_DELTA;
+    else if (KnobCompress.Value() == "lz")
+        trace_header.encoding = TRACE_ENCODING_DELTA_LZ;
+    else if (KnobCompress.Value() != "none")
+      {
+        printf("Error: unknown -compress %s\n", KnobCompress.Value().c_str());
+        return 1;
+      }
+    InitLock(&lock);
+
+    if (!sampler.Init(KnobSample.Value(), KnobSampleLen.Value(),
+                      KnobSampleSkip.Value(), KnobSampleRate.Value(),
+                      KnobSampleSeed.Value()))
+      {
+        printf("Error: unknown -sample %s\n", KnobSample.Value().c_str());
+        return 1;
+      }
+
+    if (!Simulating())
+      WriteTrace(&trace_header, sizeof(trace_header));
 
     // Initialize the memory reference buffer;
     // set up the callback to process the buffer.
@@ -201,11 +925,38 @@ int main(int argc, char *argv[])
       }
 
 
-    // Register Instruction function to be called with each executed inst.
-    INS_AddInstrumentFunction(Instruction, 0);
+    // Per thread count of instructions not yet in a record
+    gap_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(gap_reg))
+      {
+        printf("Error: no tool register left\n");
+        return 1;
+      }
+
+    if (sampler.Enabled())
+      {
+        sample_reg = PIN_ClaimToolRegister();
+        sample_key = PIN_CreateThreadDataKey(0);
+        if (!REG_valid(sample_reg))
+          {
+            printf("Error: no tool register left\n");
+            return 1;
+          }
+        PIN_AddThreadFiniFunction(ThreadFini, 0);
+      }
+
+    // Register Trace function to instrument each new trace
+    TRACE_AddInstrumentFunction(Trace, 0);
+
+    // Register ImageLoad to find the ROI; start outside of it
+    if (KnobRoi.Value())
+      {
+        ENABLE_LOGGING = FALSE;
+        IMG_AddInstrumentFunction(ImageLoad, 0);
+      }
 
-    // Register ImageLoad to be called when each image is loaded.
-    //IMG_AddInstrumentFunction(ImageLoad, 0);
+    // Register ThreadStart to count the threads for the trace header
+    PIN_AddThreadStartFunction(ThreadStart, 0);
 
     // Register Fini to be called when the application exits
     PIN_AddFiniFunction(Fini, 0);
@@ -1,7 +1,14 @@
 #include <stdio.h>
+#include <sched.h>
+#include <map>
+#include <vector>
 #include "pin.H"
 #include "instlib.H"
-#include <Python.h>
+#include "pa_translate.H"
+#include "pagemap_snapshot.H"
+#include "map_watch.H"
+#include "epoch_sampler.H"
+#include "numa_nodes.H"
 
 #define PIN_FAST_ANALYSIS_CALL
 
@@ -10,22 +17,101 @@ using namespace INSTLIB;
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
     "o", "malloc_mt.out", "specify output file name");
 
+KNOB<BOOL> KnobMapDump(KNOB_MODE_WRITEONCE, "pintool",
+    "mapdump", "0", "also dump the VA->PA mappings that changed at each "
+    "ROI boundary (the PAs in the trace are kept right without it)");
+
+KNOB<UINT32> KnobEpochMs(KNOB_MODE_WRITEONCE, "pintool",
+    "epoch_ms", "0", "every that many ms, look again at the frames of the "
+    "pages in use and log the ones that moved to <output file>.epochs "
+    "(0: off)");
+
+KNOB<UINT32> KnobEpochTtl(KNOB_MODE_WRITEONCE, "pintool",
+    "epoch_ttl", "10", "epochs a page is watched for after its last reference");
+
+KNOB<BOOL> KnobNuma(KNOB_MODE_WRITEONCE, "pintool",
+    "numa", "0", "add the NUMA node of the frame to each record and write "
+    "local/remote counts per thread, region and PC to <output file>.numa");
+
+KNOB<UINT32> KnobNumaPcs(KNOB_MODE_WRITEONCE, "pintool",
+    "numa_pcs", "50", "PCs with the most remote references listed by -numa");
+
 /*
  * The ID of the buffer
  */
 BUFFER_ID bufId;
 
+/*
+ * Per thread, the first record of its buffer not translated yet: the
+ * records before it were translated at the entry of a mapping call.
+ * Under lock.
+ */
+TLS_KEY untranslated_key;
+
 
 /*
  * The output trace file format
- * <IP> <EA> <SIZE> <R/W> <# inst executed b/w this and prev. memory inst.>
+ * <SIZE> <R/W> <IP> <EA> <PA> <PAGE SIZE> <INST ID>
+ * PA is 0 when the page is not present (e.g. swapped out).  PAGE SIZE
+ * is the size in KB of the page holding EA: 4, 2048 or 1048576.
+ * INST ID indexes the static instruction table written at the end to
+ * <output file>.inst, one line per instruction:
+ * <INST ID> <IP> <MNEMONIC> <#OPERANDS> <#MEM OPERANDS> <READ SIZE> <WRITE SIZE> <DISASSEMBLY>
+ * With -numa each record ends with the NUMA node of the frame, -1 if
+ * the page is not present.
  */
 FILE * trace;
 
-char* g_argv;
+/*
+ * VA->PA translation through /proc/self/pagemap
+ */
+PA_TRANSLATOR translator;
 
-UINT64 ctr = 0;
-char _inst[4096*4096][32];
+/*
+ * Invalidates the translations the application's mapping system calls
+ * change.  lock guards the translator, the trace file and the snapshot.
+ */
+MAP_WATCH map_watch;
+PIN_LOCK lock;
+
+/*
+ * -epoch_ms: the sampler thread watching the frames of recently touched
+ * pages, and the number of records written so far, under lock
+ */
+EPOCH_SAMPLER sampler;
+UINT64 records = 0;
+
+/*
+ * -numa: node of every frame and CPU, the counts, and our copy of the
+ * maps to name regions by, read again after mapping calls; under lock
+ */
+NUMA_MAP numa;
+NUMA_PROFILE numa_profile;
+std::vector<VMA> numa_maps;
+UINT64 numa_maps_calls = ~0ULL;
+
+/*
+ * Mappings as of the last ROI boundary
+ */
+PAGEMAP_SNAPSHOT snapshot;
+
+/*
+ * Static instructions, interned at instrumentation time.  An
+ * instruction keeps its ID if Pin instruments it again.
+ */
+struct INST_INFO
+{
+  ADDRINT     ip;
+  string      mnemonic;
+  string      disassembly;
+  UINT32      operands;
+  UINT32      memOperands;
+  UINT32      readSize;
+  UINT32      writeSize;
+};
+
+std::vector<INST_INFO> inst_table;
+std::map<ADDRINT, UINT32> inst_ids;
 
 
 /*
@@ -44,7 +130,9 @@ struct MEMREF
   ADDRINT     ea;
   UINT32      size;
   BOOL        read;
-  char*       inst;
+  UINT32      inst_id;
+  ADDRINT     pa;   // filled in by TranslateRecords
+  UINT32      page_shift;
 };
 
 BOOL ENABLE_LOGGING = FALSE;
@@ -55,68 +143,31 @@ BOOL ENABLE_LOGGING = FALSE;
  *==============================================================
  */
 
-
-void exec_pycode()
-{
-  Py_Initialize();
-
-  // ugly hack to get python to open the trace file
-  char* py_argv[2];
-  py_argv[0] = "gen_PA.py";
-  py_argv[1] = g_argv;
-
-  PySys_SetArgv(2, py_argv);
-
-  FILE* py_gen_PA = fopen("gen_PA.py", "r");
-  if(py_gen_PA == NULL)
-    {
-      printf("Could not open file gen_PA.py\n");
-      exit(0);
-    }
-
-  PyRun_SimpleFileEx(py_gen_PA,"gen_PA.py",1);
-
-  Py_Finalize();
-}
-
 // This routine is executed when __parsec_roi_begin() is called.
+// The trace file and the snapshot are shared with BufferFull.
 VOID BeforeROI( THREADID threadid )
 {
-
-    // Open the trace file    
-    trace = fopen(KnobOutputFile.Value().c_str(), "w");// error check here!!
+    GetLock(&lock, threadid+1);
     fprintf(trace, "thread %d entered ROI\n", threadid);
-    fflush(trace);
-    fclose(trace); // error check here!!
-
-    /*
-      now dump the VA->PA mappings from pagemap file for each 
-      memory section in the trace file here
-    */
-    exec_pycode();
 
+    // dump the VA->PA mappings that changed since the last boundary
+    if (KnobMapDump.Value())
+      snapshot.Update(trace);
+    fflush(trace);
+    ReleaseLock(&lock);
     ENABLE_LOGGING = TRUE;
-    // Open the trace file again
-    trace = fopen(KnobOutputFile.Value().c_str(), "a");// error check here!!
 }
 
-// This routine is executed when __parsec_roi_begin() is called.
+// This routine is executed when __parsec_roi_end() is called.
 VOID AfterROI( THREADID threadid )
 {
-    trace = fopen(KnobOutputFile.Value().c_str(), "a");// error check here!!
-    fprintf(trace, "thread %d exited ROI\n#eof\n", threadid);
+    GetLock(&lock, threadid+1);
+    fprintf(trace, "thread %d exited ROI\n", threadid);
+    if (KnobMapDump.Value())
+      snapshot.Update(trace);
     fflush(trace);
-    fclose(trace); // error check here!!
-
-    /*
-      now dump the VA->PA mappings from pagemap file for each 
-      memory section in the trace file here
-    */
-    exec_pycode();
+    ReleaseLock(&lock);
     ENABLE_LOGGING = FALSE;
-
-    // Open the trace file again
-    trace = fopen(KnobOutputFile.Value().c_str(), "a");// error check here!!
 }
 
 
@@ -128,27 +179,86 @@ VOID AfterROI( THREADID threadid )
  **************************************************************************
  */
 
+// Fill in the PAs of the records [reference, end), under lock
+VOID TranslateRecords(struct MEMREF * reference, struct MEMREF * end)
+{
+  for (; reference < end; reference++)
+    {
+      reference->pa = 0;
+      reference->page_shift = 0;
+      if (reference->pc != 0 && reference->ea != 0)
+	{
+	  reference->pa = translator.Translate(reference->ea, &reference->page_shift);
+	  if (KnobEpochMs.Value())
+	    sampler.Touch(reference->ea >> translator.PageShift());
+	}
+    }
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+  PIN_SetThreadData(untranslated_key, PIN_GetBufferPointer(ctxt, bufId), tid);
+}
+
+// The references buffered so far were made against the mappings the
+// call is about to change: translate them now
+VOID BeforeMappingCall(THREADID tid, CONTEXT *ctxt, VOID *v)
+{
+  struct MEMREF * from = (struct MEMREF *) PIN_GetThreadData(untranslated_key, tid);
+  struct MEMREF * end = (struct MEMREF *) PIN_GetBufferPointer(ctxt, bufId);
+  if (from == NULL || end < from)
+    return;
+  TranslateRecords(from, end);
+  PIN_SetThreadData(untranslated_key, end, tid);
+}
+
 VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
                   unsigned numElements, VOID *v)
 {
   struct MEMREF * reference=(struct MEMREF*)buf;
+  GetLock(&lock, tid+1);
+  struct MEMREF * from = (struct MEMREF *) PIN_GetThreadData(untranslated_key, tid);
+  if (from < reference || from > reference + numElements)
+    from = reference;
+  TranslateRecords(from, reference + numElements);
+  // the buffer is given back to be filled again from the start
+  PIN_SetThreadData(untranslated_key, buf, tid);
+  // the buffer is handled on the thread it came from: its references
+  // are counted against the CPU the thread is on now, once per buffer
+  int cpu_node = 0;
+  if (KnobNuma.Value())
+    {
+      cpu_node = numa.NodeOfCpu(sched_getcpu());
+      if (numa_maps_calls != map_watch.Calls())
+        {
+          PROC_ReadMaps(numa_maps);
+          numa_maps_calls = map_watch.Calls();
+        }
+    }
   for(unsigned int i=0; i<numElements; i++, reference++)
     {
       if (reference->pc != 0){
-	fprintf(trace,"%d %d %p %p ",
+	fprintf(trace,"%d %d %p %p %p %d %u",
 		reference->size, reference->read, 
-		(VOID*)reference->pc, (VOID*)reference->ea);
-	//(reference->inst));
-
-	for(int j=0; j<32; j++)
-	  fprintf(trace,"%c",reference->inst[j]);
-
-	fprintf(trace,"\n");
-
+		(VOID*)reference->pc, (VOID*)reference->ea,
+		(VOID*)reference->pa,
+		reference->page_shift ? (1 << (reference->page_shift - 10)) : 0,
+		reference->inst_id);
+	if (KnobNuma.Value())
+	  {
+	    int node = reference->pa != 0
+	      ? numa.NodeOfPfn(reference->pa >> translator.PageShift()) : -1;
+	    int v = PROC_FindVma(numa_maps, reference->ea);
+	    numa_profile.Access(tid, cpu_node, node, reference->pc,
+				v < 0 ? NULL : &numa_maps[v]);
+	    fprintf(trace, " %d", node);
+	  }
+	fprintf(trace, "\n");
+	records++;
       }
     }
   fflush(trace);
-  ctr = 0;
+  ReleaseLock(&lock);
   return buf;
 }
 
@@ -181,6 +291,32 @@ VOID ImageLoad(IMG img, VOID *)
     }
 }
 
+/*
+ * ID of the instruction at the IP of ins, adding it to the table the
+ * first time it is seen
+ */
+UINT32 InternInstruction(INS ins)
+{
+  ADDRINT ip = INS_Address(ins);
+  std::map<ADDRINT, UINT32>::iterator it = inst_ids.find(ip);
+  if (it != inst_ids.end())
+    return it->second;
+
+  INST_INFO info;
+  info.ip = ip;
+  info.mnemonic = INS_Mnemonic(ins);
+  info.disassembly = INS_Disassemble(ins);
+  info.operands = INS_OperandCount(ins);
+  info.memOperands = INS_MemoryOperandCount(ins);
+  info.readSize = INS_IsMemoryRead(ins) ? INS_MemoryReadSize(ins) : 0;
+  info.writeSize = INS_IsMemoryWrite(ins) ? INS_MemoryWriteSize(ins) : 0;
+
+  UINT32 id = inst_table.size();
+  inst_table.push_back(info);
+  inst_ids[ip] = id;
+  return id;
+}
+
 /*
  * Called for every instruction and instruments reads and writes
  */
@@ -195,12 +331,8 @@ VOID Instruction(INS ins, VOID *v)
   if(INS_Valid(ins) )
   {
 
-    memset(&(_inst[ctr]), '\0',32);
-    string temp = INS_Disassemble(ins);
-    temp.copy(_inst[ctr], temp.size());
-
+    UINT32 inst_id = InternInstruction(ins);
     UINT32 refSize;
-    //char* inst_name = strdup(INS_Disassemble(ins).c_str());
 
     if (INS_IsMemoryRead(ins))
     {
@@ -210,7 +342,7 @@ VOID Instruction(INS ins, VOID *v)
 			   IARG_MEMORYREAD_EA, offsetof(struct MEMREF, ea),
 			   IARG_UINT32, refSize, offsetof(struct MEMREF, size),
 			   IARG_BOOL, TRUE, offsetof(struct MEMREF, read),
-			   IARG_ADDRINT, (ADDRINT) _inst[ctr], offsetof(struct MEMREF, inst),
+			   IARG_UINT32, inst_id, offsetof(struct MEMREF, inst_id),
 			   IARG_END);
     }
     else if (INS_IsMemoryWrite(ins))
@@ -221,6 +353,7 @@ VOID Instruction(INS ins, VOID *v)
 			   IARG_MEMORYWRITE_EA, offsetof(struct MEMREF, ea),
 			   IARG_UINT32, refSize, offsetof(struct MEMREF, size),
 			   IARG_BOOL, FALSE, offsetof(struct MEMREF, read),
+			   IARG_UINT32, inst_id, offsetof(struct MEMREF, inst_id),
 			   IARG_END);
     }
     else
@@ -230,19 +363,68 @@ VOID Instruction(INS ins, VOID *v)
 			   IARG_PTR, 0, offsetof(struct MEMREF, ea),
 			   IARG_UINT32, 0, offsetof(struct MEMREF, size),
 			   IARG_BOOL, FALSE, offsetof(struct MEMREF, read),
+			   IARG_UINT32, inst_id, offsetof(struct MEMREF, inst_id),
 			   IARG_END);
     }
-       ctr++; //free(inst_name);
   }
 }
 
+// Write the static instruction table next to the trace
+VOID DumpInstructionTable()
+{
+    string name = KnobOutputFile.Value() + ".inst";
+    FILE * out = fopen(name.c_str(), "w");
+    if (out == NULL)
+    {
+        printf("Error: could not open %s\n", name.c_str());
+        return;
+    }
+    for (UINT32 i = 0; i < inst_table.size(); i++)
+    {
+        const INST_INFO & info = inst_table[i];
+        fprintf(out, "%u %p %s %u %u %u %u %s\n", i, (VOID*)info.ip,
+                info.mnemonic.c_str(), info.operands, info.memOperands,
+                info.readSize, info.writeSize, info.disassembly.c_str());
+    }
+    fclose(out);
+}
+
+
+// The sampler thread must be gone before Fini
+VOID PrepareForFini(VOID *v)
+{
+    sampler.Stop();
+}
 
 VOID Fini(INT32 code, VOID *v)
 {
+    fprintf(trace, "# pagemap translations: %llu hits, %llu misses, %llu reads, "
+            "%llu huge pages, %llu invalidations by %llu mapping calls\n",
+            (unsigned long long) translator.Hits(),
+            (unsigned long long) translator.Misses(),
+            (unsigned long long) translator.Reads(),
+            (unsigned long long) translator.LargeFills(),
+            (unsigned long long) translator.Invalidations(),
+            (unsigned long long) map_watch.Calls());
     fflush(trace);
     fprintf(trace, "#eof\n");
     fflush(trace);
     fclose(trace);
+
+    DumpInstructionTable();
+
+    if (KnobNuma.Value())
+    {
+        string name = KnobOutputFile.Value() + ".numa";
+        FILE * out = fopen(name.c_str(), "w");
+        if (out == NULL)
+        {
+            printf("Error: could not open %s\n", name.c_str());
+            return;
+        }
+        numa_profile.Print(out, KnobNumaPcs.Value());
+        fclose(out);
+    }
 }
 
 
@@ -252,11 +434,34 @@ int main(int argc, char *argv[])
     PIN_InitSymbols();
     PIN_Init(argc, argv);
 
-    for(int i = 0; i< argc; i++)
-      printf("%s, ",argv[i]);
-    // this is a horrible hack to read the output trace file's name 
-    // which is then exported to python
-    g_argv = argv[15];
+    // Open the trace file
+    trace = fopen(KnobOutputFile.Value().c_str(), "w");
+    if(trace == NULL)
+      {
+        printf("Error: could not open %s\n", KnobOutputFile.Value().c_str());
+        return 1;
+      }
+
+    // The pagemap of the tool is the pagemap of the application
+    if(!translator.Open())
+      {
+        printf("Error: could not open /proc/self/pagemap\n");
+        return 1;
+      }
+    snapshot.Open();
+    InitLock(&lock);
+    map_watch.Start(&translator, &lock, BeforeMappingCall);
+    if (KnobNuma.Value())
+      {
+        // a machine without NUMA is one node
+        numa.Load(translator.PageSize());
+        numa_profile.Init(numa.Nodes());
+      }
+    if (KnobEpochMs.Value()
+        && !sampler.Start((KnobOutputFile.Value() + ".epochs").c_str(),
+                          KnobEpochMs.Value(), KnobEpochTtl.Value(),
+                          &translator, &lock, &records))
+      return 1;
 
 
     // Initialize the memory reference buffer;
@@ -268,6 +473,8 @@ int main(int argc, char *argv[])
         printf("Error: could not allocate initial buffer\n");
         return 1;
       }
+    untranslated_key = PIN_CreateThreadDataKey(0);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
 
 
     // Register Instruction function to be called with each executed inst.
@@ -276,7 +483,9 @@ int main(int argc, char *argv[])
     // Register ImageLoad to be called when each image is loaded.
     IMG_AddInstrumentFunction(ImageLoad, 0);
 
-    // Register Fini to be called when the application exits
+    // Register PrepareForFini to stop the sampler and Fini to be called
+    // when the application exits
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
@@ -0,0 +1,276 @@
+/*
+ * memrank: VSS/RSS/PSS/USS of every process, ranked by PSS, as the
+ * pagewatch_demo memrank script prints them
+ *
+ *   RSS   pages present in memory
+ *   PSS   each present page divided by the number of mappings of it
+ *         (/proc/kpagecount)
+ *   USS   pages mapped only once
+ *
+ * /proc/kpagecount is read once per pass, in large chunks, into a table
+ * of 32-bit counts.  The processes are then measured by -j threads that
+ * take the next PID off a shared counter; each reads the pagemap
+ * entries of the regions in its maps only, skipping the unmapped space
+ * between them and the no-access regions.
+ *
+ * Needs root: without CAP_SYS_ADMIN pagemap has no PFNs and every page
+ * counts as shared by nobody, so PSS and USS come out as 0.
+ *
+ * usage: memrank [-j <threads>] [-i <seconds>] [<pid>...]
+ *   -i   measure again every <seconds>, as a continuous metric
+ *   pid  only these processes (as memstats does)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "proc_maps.H"
+#include "pa_translate.H"
+
+// bytes of /proc/kpagecount read at a time
+#define KPAGECOUNT_CHUNK  (8 << 20)
+// pagemap entries read at a time
+#define PAGEMAP_CHUNK     4096
+
+struct PROC_MEM
+{
+  int           pid;
+  std::string   name;
+  uint64_t      vss;
+  uint64_t      rss;
+  uint64_t      pss;
+  uint64_t      uss;
+
+  // by PSS, largest first, then by pid
+  bool operator<(const PROC_MEM &o) const
+  {
+    return pss != o.pss ? pss > o.pss : pid < o.pid;
+  }
+};
+
+static std::vector<uint32_t> kpagecount;
+static uint64_t page_size;
+
+/*
+ * Read /proc/kpagecount into kpagecount, saturating at 2^32 - 1
+ */
+static bool ReadKpagecount()
+{
+  int fd = open("/proc/kpagecount", O_RDONLY);
+  if (fd < 0)
+    return false;
+  std::vector<uint64_t> buf(KPAGECOUNT_CHUNK / sizeof(uint64_t));
+  size_t pfn = 0;
+  for (;;)
+    {
+      ssize_t got = pread(fd, &buf[0], KPAGECOUNT_CHUNK, pfn * sizeof(uint64_t));
+      if (got <= 0)
+        break;
+      got /= sizeof(uint64_t);
+      if (kpagecount.size() < pfn + got)
+        kpagecount.resize(pfn + got);
+      for (ssize_t i = 0; i < got; i++)
+        kpagecount[pfn + i] = buf[i] > 0xffffffffULL ? 0xffffffffu : (uint32_t) buf[i];
+      pfn += got;
+    }
+  close(fd);
+  return true;
+}
+
+static std::string ProcName(int pid)
+{
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return "";
+  std::string name;
+  if (fgets(line, sizeof(line), f) != NULL && strncmp(line, "Name:", 5) == 0)
+    {
+      const char *p = line + 5;
+      while (*p == ' ' || *p == '\t')
+        p++;
+      name = p;
+      while (!name.empty() && name[name.size() - 1] == '\n')
+        name.erase(name.size() - 1);
+    }
+  fclose(f);
+  return name;
+}
+
+/*
+ * Measure one process.  A process we cannot read (gone, no permission)
+ * keeps its zeros.
+ */
+static void Measure(PROC_MEM &p)
+{
+  char pid[16];
+  snprintf(pid, sizeof(pid), "%d", p.pid);
+  p.name = ProcName(p.pid);
+  p.vss = p.rss = p.pss = p.uss = 0;
+
+  std::vector<VMA> maps;
+  if (!PROC_ReadMaps(maps, pid))
+    return;
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/pagemap", p.pid);
+  int fd = open(path, O_RDONLY);
+
+  uint64_t buf[PAGEMAP_CHUNK];
+  for (size_t m = 0; m < maps.size(); m++)
+    {
+      const VMA &v = maps[m];
+      p.vss += v.end - v.start;
+      if (fd < 0 || v.NoAccess())
+        continue;
+      for (uint64_t vpn = v.start / page_size; vpn < v.end / page_size; )
+        {
+          uint64_t todo = v.end / page_size - vpn;
+          if (todo > PAGEMAP_CHUNK)
+            todo = PAGEMAP_CHUNK;
+          ssize_t got = pread(fd, buf, todo * sizeof(uint64_t), vpn * sizeof(uint64_t));
+          if (got <= 0)
+            break;
+          got /= sizeof(uint64_t);
+          for (ssize_t i = 0; i < got; i++)
+            {
+              uint64_t e = buf[i];
+              if (!(e & PM_PRESENT) || (e & PM_SWAPPED))
+                continue;
+              p.rss += page_size;
+              uint64_t pfn = e & PM_PFN_MASK;
+              uint32_t c = pfn < kpagecount.size() ? kpagecount[pfn] : 0;
+              if (c == 1)
+                p.uss += page_size;
+              if (c)
+                p.pss += page_size / c;
+            }
+          vpn += got;
+        }
+    }
+  if (fd >= 0)
+    close(fd);
+}
+
+struct WORK
+{
+  std::vector<PROC_MEM> *   procs;
+  volatile size_t           next;
+};
+
+static void * Worker(void *arg)
+{
+  WORK *w = (WORK *) arg;
+  for (;;)
+    {
+      size_t i = __sync_fetch_and_add(&w->next, 1);
+      if (i >= w->procs->size())
+        break;
+      Measure((*w->procs)[i]);
+    }
+  return NULL;
+}
+
+static void ListPids(std::vector<PROC_MEM> &procs)
+{
+  DIR *d = opendir("/proc");
+  if (d == NULL)
+    return;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL)
+    {
+      if (!isdigit((unsigned char) de->d_name[0]))
+        continue;
+      PROC_MEM p;
+      p.pid = atoi(de->d_name);
+      procs.push_back(p);
+    }
+  closedir(d);
+}
+
+static void Pass(const std::vector<int> &pids, unsigned nthreads)
+{
+  kpagecount.clear();
+  if (!ReadKpagecount())
+    fprintf(stderr, "could not read /proc/kpagecount, PSS and USS will be 0\n");
+
+  std::vector<PROC_MEM> procs;
+  if (pids.empty())
+    ListPids(procs);
+  for (size_t i = 0; i < pids.size(); i++)
+    {
+      PROC_MEM p;
+      p.pid = pids[i];
+      procs.push_back(p);
+    }
+
+  WORK work;
+  work.procs = &procs;
+  work.next = 0;
+  std::vector<pthread_t> threads;
+  for (unsigned t = 1; t < nthreads && t < procs.size(); t++)
+    {
+      pthread_t th;
+      if (pthread_create(&th, NULL, Worker, &work) == 0)
+        threads.push_back(th);
+    }
+  Worker(&work);
+  for (size_t t = 0; t < threads.size(); t++)
+    pthread_join(threads[t], NULL);
+
+  std::sort(procs.begin(), procs.end());
+  printf("               VSS      RSS      PSS      USS\n");
+  for (size_t i = 0; i < procs.size(); i++)
+    printf("%8d: %7lluk %7lluk %7lluk %7lluk   %s\n", procs[i].pid,
+           (unsigned long long) procs[i].vss / 1024,
+           (unsigned long long) procs[i].rss / 1024,
+           (unsigned long long) procs[i].pss / 1024,
+           (unsigned long long) procs[i].uss / 1024,
+           procs[i].name.c_str());
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned interval = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:i:")) != -1)
+    {
+      if (opt == 'j')
+        nthreads = atoi(optarg);
+      else if (opt == 'i')
+        interval = atoi(optarg);
+      else
+        {
+          fprintf(stderr, "usage: %s [-j <threads>] [-i <seconds>] [<pid>...]\n",
+                  argv[0]);
+          return 1;
+        }
+    }
+  if (nthreads == 0)
+    nthreads = 1;
+  page_size = sysconf(_SC_PAGESIZE);
+
+  std::vector<int> pids;
+  for (int i = optind; i < argc; i++)
+    pids.push_back(atoi(argv[i]));
+
+  for (;;)
+    {
+      Pass(pids, nthreads);
+      if (interval == 0)
+        break;
+      sleep(interval);
+      printf("\n");
+    }
+  return 0;
+}
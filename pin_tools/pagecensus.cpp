@@ -0,0 +1,139 @@
+/*
+ * pagecensus: state of every page frame of the machine, from a bitmap
+ * index of /proc/kpageflags (kpageflags_index.H)
+ *
+ * Without queries, prints how many frames have each flag.  A query is a
+ * comma separated list of flag names, each maybe negated with '!', and
+ * counts the frames with all of them:
+ *
+ *   pagecensus anon,!lru huge
+ *
+ *   -j <threads>   threads reading kpageflags
+ *   -r <lo>-<hi>   only frames [lo, hi) (PFNs, hex)
+ *   -l             list the runs of frames matching each query
+ *   -b <frames>    flag counts per bucket of that many frames
+ *   -i <seconds>   refresh and print again every <seconds>; only the
+ *                  blocks of frames that changed are re-indexed
+ *
+ * Needs root to read /proc/kpageflags.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "kpageflags_index.H"
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void PrintRun(uint64_t lo, uint64_t hi, void *)
+{
+  printf("  %llx-%llx\n", (unsigned long long) lo, (unsigned long long) hi);
+}
+
+static void Usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-j <threads>] [-r <lo>-<hi>] [-l] [-b <frames>] "
+          "[-i <seconds>] [<flag>[,[!]<flag>...]...]\n", argv0);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned interval = 0;
+  unsigned long long lo = 0, hi = ~0ULL, bucket = 0;
+  bool list = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:r:lb:i:")) != -1)
+    {
+      if (opt == 'j')
+        nthreads = atoi(optarg);
+      else if (opt == 'r')
+        {
+          if (sscanf(optarg, "%llx-%llx", &lo, &hi) != 2)
+            Usage(argv[0]);
+        }
+      else if (opt == 'l')
+        list = true;
+      else if (opt == 'b')
+        bucket = strtoull(optarg, NULL, 0);
+      else if (opt == 'i')
+        interval = atoi(optarg);
+      else
+        Usage(argv[0]);
+    }
+
+  std::vector<KPF_QUERY> queries(argc - optind);
+  for (int i = optind; i < argc; i++)
+    if (!queries[i - optind].Parse(argv[i]))
+      {
+        fprintf(stderr, "bad query %s, flags are:", argv[i]);
+        for (int f = 0; f < KPF_INDEX_FLAGS; f++)
+          fprintf(stderr, " %s", KPF_NAMES[f]);
+        fprintf(stderr, "\n");
+        return 1;
+      }
+
+  uint64_t pageKb = sysconf(_SC_PAGESIZE) / 1024;
+  KPAGEFLAGS_INDEX index;
+  for (;;)
+    {
+      double t = Now();
+      if (!index.Refresh(nthreads))
+        {
+          fprintf(stderr, "could not read /proc/kpageflags\n");
+          return 1;
+        }
+      printf("# %llu frames, %llu blocks re-indexed in %.3f s\n",
+             (unsigned long long) index.Frames(),
+             (unsigned long long) index.Changed(), Now() - t);
+
+      if (queries.empty() && bucket == 0)
+        {
+          uint64_t counts[KPF_INDEX_FLAGS];
+          index.Histogram(lo, hi, counts);
+          for (int f = 0; f < KPF_INDEX_FLAGS; f++)
+            printf("%-14s %12llu frames %12llu kB\n", KPF_NAMES[f],
+                   (unsigned long long) counts[f],
+                   (unsigned long long) (counts[f] * pageKb));
+        }
+
+      for (size_t q = 0; q < queries.size(); q++)
+        {
+          uint64_t n = index.Count(queries[q], lo, hi);
+          printf("%-24s %12llu frames %12llu kB\n", argv[optind + q],
+                 (unsigned long long) n, (unsigned long long) (n * pageKb));
+          if (list)
+            index.List(queries[q], PrintRun, NULL, lo, hi);
+        }
+
+      if (bucket != 0)
+        {
+          printf("# range");
+          for (int f = 0; f < KPF_INDEX_FLAGS; f++)
+            printf(" %s", KPF_NAMES[f]);
+          printf("\n");
+          uint64_t end = hi < index.Frames() ? hi : index.Frames();
+          for (uint64_t b = lo; b < end; b += bucket)
+            {
+              uint64_t counts[KPF_INDEX_FLAGS];
+              uint64_t e = b + bucket < end ? b + bucket : end;
+              index.Histogram(b, e, counts);
+              printf("%llx-%llx", (unsigned long long) b, (unsigned long long) e);
+              for (int f = 0; f < KPF_INDEX_FLAGS; f++)
+                printf(" %llu", (unsigned long long) counts[f]);
+              printf("\n");
+            }
+        }
+
+      fflush(stdout);
+      if (interval == 0)
+        break;
+      sleep(interval);
+    }
+  return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * pagemapd: publish the VA->PA changes of one or more processes as a
+ * stream of deltas (pagemap_stream.H), for pagemapwatch and dashboards
+ *
+ * Every interval each process is looked at again and a frame with the
+ * pages whose PFN changed is written.  The first frame of a process
+ * (and the first after a reader reconnects) has all of its present
+ * pages.  A process that exits is dropped; pagemapd exits when none is
+ * left.
+ *
+ * The output is a FIFO, created if needed, or stdout.  When the reader
+ * of the FIFO goes away, pagemapd waits for the next one and starts it
+ * off with full frames again.
+ *
+ * Needs root for the PFNs and the mapcounts.
+ *
+ * usage: pagemapd [-i <ms>] [-o <fifo>] [-t] <pid>...
+ *   -i   interval, 100 ms by default
+ *   -t   text instead of binary: "<pid> <seq> <vpn> <old pfn> <new pfn>
+ *        <mapcount>", hex except the mapcount
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "trace_format.H"
+#include "pagemap_stream.H"
+
+static const char * fifo_path = NULL;
+static int out_fd = 1;
+
+static uint64_t NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// (re)open the FIFO, waiting for a reader
+static bool OpenOutput()
+{
+  if (fifo_path == NULL)
+    return true;
+  struct stat st;
+  if (stat(fifo_path, &st) < 0 && mkfifo(fifo_path, 0644) < 0)
+    {
+      fprintf(stderr, "could not create %s\n", fifo_path);
+      return false;
+    }
+  out_fd = open(fifo_path, O_WRONLY);
+  if (out_fd < 0)
+    {
+      fprintf(stderr, "could not open %s\n", fifo_path);
+      return false;
+    }
+  return true;
+}
+
+static bool WriteFrame(const PAGEMAP_TRACKER &t, const std::vector<PAGEMAP_DELTA> &deltas,
+                       bool text, std::string &buf)
+{
+  buf.clear();
+  if (text)
+    {
+      char line[128];
+      for (size_t i = 0; i < deltas.size(); i++)
+        {
+          const PAGEMAP_DELTA &d = deltas[i];
+          int n = snprintf(line, sizeof(line), "%d %u %llx %llx %llx %llu\n",
+                           t.Pid(), t.Seq() - 1, (unsigned long long) d.vpn,
+                           (unsigned long long) d.old_pfn,
+                           (unsigned long long) d.new_pfn,
+                           (unsigned long long) d.mapcount);
+          buf.append(line, n);
+        }
+    }
+  else
+    {
+      PAGEMAP_FRAME f;
+      f.magic = PAGEMAP_STREAM_MAGIC;
+      f.pid = t.Pid();
+      f.seq = t.Seq() - 1;
+      f.count = deltas.size();
+      f.time_ns = NowNs();
+      buf.append((const char *) &f, sizeof(f));
+      if (!deltas.empty())
+        buf.append((const char *) &deltas[0], deltas.size() * sizeof(deltas[0]));
+    }
+  return TRACE_WriteAll(out_fd, buf.data(), buf.size());
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned interval = 100;
+  bool text = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:o:t")) != -1)
+    {
+      if (opt == 'i')
+        interval = atoi(optarg);
+      else if (opt == 'o')
+        fifo_path = optarg;
+      else if (opt == 't')
+        text = true;
+      else
+        optind = argc;
+    }
+  if (optind >= argc)
+    {
+      fprintf(stderr, "usage: %s [-i <ms>] [-o <fifo>] [-t] <pid>...\n", argv[0]);
+      return 1;
+    }
+
+  // a reader going away is handled at the write
+  signal(SIGPIPE, SIG_IGN);
+  if (!OpenOutput())
+    return 1;
+
+  std::vector<int> pids;
+  for (int i = optind; i < argc; i++)
+    pids.push_back(atoi(argv[i]));
+
+  std::vector<PAGEMAP_TRACKER *> trackers;
+  for (size_t i = 0; i < pids.size(); i++)
+    {
+      PAGEMAP_TRACKER *t = new PAGEMAP_TRACKER;
+      if (!t->Open(pids[i]))
+        {
+          fprintf(stderr, "could not open the pagemap of %d\n", pids[i]);
+          delete t;
+          continue;
+        }
+      trackers.push_back(t);
+    }
+
+  std::vector<PAGEMAP_DELTA> deltas;
+  std::string buf;
+  while (!trackers.empty())
+    {
+      uint64_t start = NowNs();
+      bool lost = false;
+      for (size_t i = 0; i < trackers.size(); )
+        {
+          deltas.clear();
+          if (!trackers[i]->Update(deltas))
+            {
+              delete trackers[i];
+              trackers.erase(trackers.begin() + i);
+              continue;
+            }
+          if (!WriteFrame(*trackers[i], deltas, text, buf))
+            {
+              lost = true;
+              break;
+            }
+          i++;
+        }
+
+      if (lost)
+        {
+          if (fifo_path == NULL || errno != EPIPE)
+            return 1;
+          // start the next reader off with full frames
+          close(out_fd);
+          for (size_t i = 0; i < trackers.size(); i++)
+            {
+              int pid = trackers[i]->Pid();
+              delete trackers[i];
+              trackers[i] = new PAGEMAP_TRACKER;
+              trackers[i]->Open(pid);
+            }
+          if (!OpenOutput())
+            return 1;
+          continue;
+        }
+
+      uint64_t spent = NowNs() - start;
+      uint64_t period = (uint64_t) interval * 1000000ULL;
+      if (spent < period)
+        {
+          struct timespec ts;
+          ts.tv_sec = (period - spent) / 1000000000ULL;
+          ts.tv_nsec = (period - spent) % 1000000000ULL;
+          nanosleep(&ts, NULL);
+        }
+    }
+  return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * reuse: reuse distance histograms and miss ratio curves of a binary
+ * trace written by the mem_trace tools (see reuse_distance.H)
+ *
+ * The traces hold virtual addresses only, so there are line and page
+ * distances but no frame ones; mem_trace_st -reuse 1 has all three.
+ *
+ * usage: reuse <trace file> [<sampling 1/N> [<output file>]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "trace_reader.H"
+#include "reuse_distance.H"
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: %s <trace file> [<sampling 1/N> [<output file>]]\n",
+              argv[0]);
+      return 1;
+    }
+
+  TRACE_READER reader;
+  if (!reader.Open(argv[1]))
+    return 1;
+
+  FILE * out = stdout;
+  if (argc > 3)
+    {
+      out = fopen(argv[3], "w");
+      if (out == NULL)
+        {
+          fprintf(stderr, "could not open %s\n", argv[3]);
+          return 1;
+        }
+    }
+
+  const TRACE_HEADER * hdr = &reader.Header();
+  unsigned page_shift = 0;
+  while ((1u << page_shift) < hdr->page_size)
+    page_shift++;
+
+  REUSE_PROFILE reuse;
+  reuse.Init(argc > 2 ? atoi(argv[2]) : 1, 6, page_shift);
+
+  const char * rec;
+  while ((rec = reader.Next()) != NULL)
+    {
+      // thread 0 for the single threaded tools' traces
+      uint32_t tid = (uint32_t) TRACE_GetField(hdr, rec, TRACE_FIELD_THREAD_ID);
+      uint64_t size = TRACE_GetField(hdr, rec, TRACE_FIELD_SIZE);
+      if (TRACE_IsMarker(hdr, rec))
+        {
+          if (size == TRACE_MARKER_ROI_BEGIN || size == TRACE_MARKER_ROI_END)
+            reuse.Roi(tid, size == TRACE_MARKER_ROI_BEGIN);
+          continue;
+        }
+      reuse.Access(tid, TRACE_GetField(hdr, rec, TRACE_FIELD_EA), 0);
+    }
+
+  if (reader.Failed())
+    {
+      fprintf(stderr, "%s is damaged\n", argv[1]);
+      return 1;
+    }
+  reuse.Print(out);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * trace2text: convert a binary trace written by the mem_trace tools back
+ * into the old text format
+ *   <IP> <EA> <SIZE> <R/W> [<# inst since prev. record>] [<THREAD ID>]
+ *   [<TIMESTAMP>]
+ *
+ * usage: trace2text <trace file> [<output file>]
+ */
+#include <stdio.h>
+#include "trace_reader.H"
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: %s <trace file> [<output file>]\n", argv[0]);
+      return 1;
+    }
+
+  TRACE_READER reader;
+  if (!reader.Open(argv[1]))
+    return 1;
+
+  FILE * out = stdout;
+  if (argc > 2)
+    {
+      out = fopen(argv[2], "w");
+      if (out == NULL)
+        {
+          fprintf(stderr, "could not open %s\n", argv[2]);
+          return 1;
+        }
+    }
+
+  const TRACE_HEADER * hdr = &reader.Header();
+  bool has_tid = TRACE_HasField(hdr, TRACE_FIELD_THREAD_ID);
+  bool has_icount = TRACE_HasField(hdr, TRACE_FIELD_ICOUNT);
+  bool has_timestamp = TRACE_HasField(hdr, TRACE_FIELD_TIMESTAMP);
+
+  fprintf(out, "# page size %u, pointer width %u, record size %u, threads %u\n",
+          hdr->page_size, hdr->pointer_width, hdr->record_size,
+          hdr->thread_count);
+
+  const char * rec;
+  while ((rec = reader.Next()) != NULL)
+    {
+      unsigned long long ea = TRACE_GetField(hdr, rec, TRACE_FIELD_EA);
+      unsigned size = (unsigned) TRACE_GetField(hdr, rec, TRACE_FIELD_SIZE);
+
+      if (TRACE_IsMarker(hdr, rec))
+        {
+          if (size == TRACE_MARKER_ROI_BEGIN)
+            fprintf(out, "thread %llu entered ROI\n", ea);
+          else if (size == TRACE_MARKER_ROI_END)
+            fprintf(out, "thread %llu exited ROI\n", ea);
+          else if (size == TRACE_MARKER_SEGMENT)
+            fprintf(out, "thread %llu segment at instruction %llu\n", ea,
+                    (unsigned long long) TRACE_GetField(hdr, rec, TRACE_FIELD_ICOUNT));
+          continue;
+        }
+
+      fprintf(out, "%llu %llu %u %u",
+              (unsigned long long) TRACE_GetField(hdr, rec, TRACE_FIELD_PC),
+              ea, size,
+              (unsigned) TRACE_GetField(hdr, rec, TRACE_FIELD_READ));
+      if (has_icount)
+        fprintf(out, " %llu",
+                (unsigned long long) TRACE_GetField(hdr, rec, TRACE_FIELD_ICOUNT));
+      if (has_tid)
+        fprintf(out, " %u",
+                (unsigned) TRACE_GetField(hdr, rec, TRACE_FIELD_THREAD_ID));
+      if (has_timestamp)
+        fprintf(out, " %llu",
+                (unsigned long long) TRACE_GetField(hdr, rec, TRACE_FIELD_TIMESTAMP));
+      fprintf(out, "\n");
+    }
+
+  if (reader.Failed())
+    {
+      fprintf(stderr, "%s is damaged, output stops there\n", argv[1]);
+      if (out != stdout)
+        fclose(out);
+      return 1;
+    }
+  fprintf(out, "#eof\n");
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
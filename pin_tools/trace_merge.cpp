@@ -0,0 +1,166 @@
+/*
+ * trace_merge: merge the per-thread traces of mem_trace_mt_FAST_bufAPI
+ * (<prefix>.<thread id>) into one trace in global timestamp order
+ *
+ * Every input has to have a timestamp field and the same record layout.
+ * Each input is in timestamp order already, so this is a k-way merge
+ * over a heap of the inputs' next records: memory is one read buffer
+ * per input and one write buffer, whatever the size of the traces.
+ * Records with the same timestamp come out in the order of the inputs
+ * on the command line.  A record without a timestamp (0) or with one
+ * lower than the previous of its input keeps its place in the input.
+ *
+ * The output is an uncompressed trace with the layout of the inputs.
+ *
+ * usage: trace_merge <output file> <trace file>...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <functional>
+#include <queue>
+#include <vector>
+#include "trace_reader.H"
+
+// bytes of records written at a time
+#define OUT_BUF_SIZE  (1 << 20)
+
+struct INPUT
+{
+  TRACE_READER    reader;
+  const char *    rec;          // next record
+  uint64_t        timestamp;    // of rec
+  uint64_t        disorder;     // records with a timestamp going backwards
+};
+
+// timestamp, input: the lower input wins the ties
+typedef std::pair<uint64_t, size_t> HEAD;
+
+static bool SameLayout(const TRACE_HEADER *a, const TRACE_HEADER *b)
+{
+  if (a->record_size != b->record_size || a->field_mask != b->field_mask)
+    return false;
+  for (unsigned f = 0; f < TRACE_FIELD_MAX; f++)
+    if (TRACE_HasField(a, (TRACE_FIELD) f)
+        && (a->field_offset[f] != b->field_offset[f]
+            || a->field_width[f] != b->field_width[f]))
+      return false;
+  return true;
+}
+
+// move input in to its next record; false at its end
+static bool Advance(INPUT *in)
+{
+  in->rec = in->reader.Next();
+  if (in->rec == NULL)
+    return false;
+  uint64_t t = TRACE_GetField(&in->reader.Header(), in->rec, TRACE_FIELD_TIMESTAMP);
+  if (t < in->timestamp)
+    {
+      if (t != 0)
+        in->disorder++;
+      t = in->timestamp;
+    }
+  in->timestamp = t;
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3)
+    {
+      fprintf(stderr, "usage: %s <output file> <trace file>...\n", argv[0]);
+      return 1;
+    }
+
+  size_t n = argc - 2;
+  std::vector<INPUT> inputs(n);
+  const TRACE_HEADER *first = NULL;
+  uint32_t threads = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      INPUT &in = inputs[i];
+      if (!in.reader.Open(argv[i + 2]))
+        return 1;
+      const TRACE_HEADER *hdr = &in.reader.Header();
+      if (!TRACE_HasField(hdr, TRACE_FIELD_TIMESTAMP))
+        {
+          fprintf(stderr, "%s has no timestamps\n", argv[i + 2]);
+          return 1;
+        }
+      if (first == NULL)
+        first = hdr;
+      else if (!SameLayout(first, hdr))
+        {
+          fprintf(stderr, "%s: record layout differs from %s\n", argv[i + 2], argv[2]);
+          return 1;
+        }
+      threads += hdr->thread_count ? hdr->thread_count : 1;
+      in.timestamp = 0;
+      in.disorder = 0;
+    }
+
+  int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      fprintf(stderr, "could not open %s\n", argv[1]);
+      return 1;
+    }
+  TRACE_HEADER hdr = *first;
+  hdr.version = TRACE_VERSION;
+  hdr.header_size = sizeof(hdr);
+  hdr.encoding = TRACE_ENCODING_RAW;
+  hdr.thread_count = threads;
+  TRACE_WriteAll(fd, &hdr, sizeof(hdr));
+
+  std::priority_queue<HEAD, std::vector<HEAD>, std::greater<HEAD> > heap;
+  for (size_t i = 0; i < n; i++)
+    if (Advance(&inputs[i]))
+      heap.push(HEAD(inputs[i].timestamp, i));
+
+  size_t recSize = hdr.record_size;
+  std::vector<char> out((OUT_BUF_SIZE / recSize + 1) * recSize);
+  size_t len = 0;
+  uint64_t records = 0;
+  while (!heap.empty())
+    {
+      size_t i = heap.top().second;
+      heap.pop();
+      INPUT &in = inputs[i];
+      // in.rec stays valid until the input is advanced
+      memcpy(&out[len], in.rec, recSize);
+      len += recSize;
+      records++;
+      if (len == out.size())
+        {
+          if (!TRACE_WriteAll(fd, &out[0], len))
+            {
+              fprintf(stderr, "could not write %s\n", argv[1]);
+              return 1;
+            }
+          len = 0;
+        }
+      if (Advance(&in))
+        heap.push(HEAD(in.timestamp, i));
+    }
+  if (len > 0 && !TRACE_WriteAll(fd, &out[0], len))
+    {
+      fprintf(stderr, "could not write %s\n", argv[1]);
+      return 1;
+    }
+  close(fd);
+
+  for (size_t i = 0; i < n; i++)
+    if (inputs[i].reader.Failed())
+      {
+        fprintf(stderr, "%s is damaged, %s is incomplete\n", argv[i + 2], argv[1]);
+        return 1;
+      }
+  for (size_t i = 0; i < n; i++)
+    if (inputs[i].disorder)
+      fprintf(stderr, "%s: %llu records out of timestamp order\n", argv[i + 2],
+              (unsigned long long) inputs[i].disorder);
+  fprintf(stderr, "merged %llu records of %u threads from %u traces\n",
+          (unsigned long long) records, threads, (unsigned) n);
+  return 0;
+}
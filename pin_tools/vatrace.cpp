@@ -0,0 +1,528 @@
+/*
+ * vatrace: add physical addresses to a text memory trace
+ *
+ * The input is a text trace of
+ *   <IP> <EA> <SIZE> <R/W> [...]
+ * lines (trace2text, numbers in decimal or 0x hex) interleaved with the
+ * mapping dumps gen_PA.py appends
+ *   <start>-<end> <name>
+ *   addr = <va> VPN = <vpn>, PFN = <pfn>
+ * or the incremental ones of pagemap_snapshot.H (#snapshot, +/-/~ region
+ * lines, addr lines with PFN 0 for pages that went away).  Every other
+ * line (comments, ROI lines) is copied as is.
+ *
+ * Each record is translated with the mappings as of the first dump
+ * after it, the one taken at the end of its ROI; records after the last
+ * dump use the last mappings.  A full dump (plain region lines)
+ * replaces the mappings, an incremental one updates them.  The output
+ * has the physical address right after EA, 0 if the page was not
+ * mapped:
+ *   <IP> <EA> <PA> <SIZE> <R/W> [...]
+ *
+ * The trace is mmap()ed.  Finding the dumps and translating the records
+ * between two dumps are both done by -j threads over chunks split on
+ * line boundaries; the output is written in order.
+ *
+ * usage: vatrace [-j <threads>] [-p <page size>] <trace file> [<output file>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+// bytes of records translated by one thread at a time, at most and
+// at least (unless there is less)
+#define BATCH_SIZE      (8 << 20)
+#define MIN_BATCH_SIZE  (64 << 10)
+
+enum LINE_KIND
+{
+  LINE_OTHER = 0,       // copied through
+  LINE_RECORD,
+  LINE_DUMP
+};
+
+/*
+ * A run of lines of one kind: dumps, or records (and other lines)
+ */
+struct SPAN
+{
+  const char *  begin;
+  const char *  end;
+  bool          dump;
+};
+
+static const char * LineEnd(const char *p, const char *end)
+{
+  const char *nl = (const char *) memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+static bool IsHex(char c)
+{
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static bool StartsWith(const char *p, const char *end, const char *s)
+{
+  size_t n = strlen(s);
+  return (size_t) (end - p) >= n && memcmp(p, s, n) == 0;
+}
+
+/*
+ * Parse a decimal or 0x hex number after optional blanks.  *hex tells
+ * which one it was.
+ */
+static const char * ParseNumber(const char *p, const char *end, uint64_t *v,
+                                bool *hex = NULL)
+{
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  uint64_t r = 0;
+  const char *start;
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+      for (p += 2, start = p; p < end && IsHex(*p); p++)
+        r = (r << 4) | (*p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10);
+      if (hex)
+        *hex = true;
+    }
+  else
+    {
+      for (start = p; p < end && *p >= '0' && *p <= '9'; p++)
+        r = r * 10 + (*p - '0');
+      if (hex)
+        *hex = false;
+    }
+  if (p == start)
+    return NULL;
+  *v = r;
+  return p;
+}
+
+static const char * ParseHex(const char *p, const char *end, uint64_t *v)
+{
+  const char *start = p;
+  uint64_t r = 0;
+  for (; p < end && IsHex(*p); p++)
+    r = (r << 4) | (*p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10);
+  *v = r;
+  return p == start ? NULL : p;
+}
+
+// "<start>-<end>", as in maps
+static const char * ParseRange(const char *p, const char *end,
+                               uint64_t *start, uint64_t *stop)
+{
+  if ((p = ParseHex(p, end, start)) == NULL || p >= end || *p != '-')
+    return NULL;
+  return ParseHex(p + 1, end, stop);
+}
+
+static LINE_KIND Classify(const char *p, const char *end)
+{
+  uint64_t a, b;
+  if (StartsWith(p, end, "addr = ") || StartsWith(p, end, "#snapshot")
+      || StartsWith(p, end, "+ ") || StartsWith(p, end, "- ")
+      || StartsWith(p, end, "~ "))
+    return LINE_DUMP;
+  if (p < end && IsHex(*p) && ParseRange(p, end, &a, &b) != NULL)
+    return LINE_DUMP;
+  if (p < end && *p >= '0' && *p <= '9')
+    return LINE_RECORD;
+  return LINE_OTHER;
+}
+
+/*
+ * Split [begin, end) into spans.  Other lines go with the records.
+ */
+static void FindSpans(const char *begin, const char *end, std::vector<SPAN> &spans)
+{
+  for (const char *p = begin; p < end; )
+    {
+      const char *next = LineEnd(p, end);
+      bool dump = Classify(p, next) == LINE_DUMP;
+      if (!spans.empty() && spans.back().dump == dump && spans.back().end == p)
+        spans.back().end = next;
+      else
+        {
+          SPAN s = { p, next, dump };
+          spans.push_back(s);
+        }
+      p = next;
+    }
+}
+
+/*
+ * VPN -> PFN as of some dump: open addressing, read only once built
+ */
+class PFN_TABLE
+{
+  public:
+    void Build(const std::map<uint64_t, uint64_t> &m)
+    {
+      size_t size = 16;
+      while (size < 2 * m.size())
+        size *= 2;
+      _mask = size - 1;
+      _slots.assign(size, SLOT());
+      for (std::map<uint64_t, uint64_t>::const_iterator i = m.begin(); i != m.end(); ++i)
+        {
+          size_t k = Hash(i->first) & _mask;
+          while (_slots[k].vpn != 0)
+            k = (k + 1) & _mask;
+          _slots[k].vpn = i->first + 1;
+          _slots[k].pfn = i->second;
+        }
+    }
+
+    uint64_t Lookup(uint64_t vpn) const
+    {
+      if (_slots.empty())
+        return 0;
+      for (size_t k = Hash(vpn) & _mask; ; k = (k + 1) & _mask)
+        {
+          if (_slots[k].vpn == vpn + 1)
+            return _slots[k].pfn;
+          if (_slots[k].vpn == 0)
+            return 0;
+        }
+    }
+
+  private:
+    struct SLOT
+    {
+      uint64_t  vpn;      // vpn + 1 so that 0 marks an empty slot
+      uint64_t  pfn;
+      SLOT() : vpn(0), pfn(0) {}
+    };
+
+    static size_t Hash(uint64_t v)
+    {
+      return (size_t) ((v * 0x9e3779b97f4a7c15ULL) >> 20);
+    }
+
+    std::vector<SLOT> _slots;
+    size_t            _mask;
+};
+
+/*
+ * Apply the lines of a dump to the mappings
+ */
+static void ApplyDump(const SPAN &s, std::map<uint64_t, uint64_t> &state,
+                      unsigned pageShift)
+{
+  bool full = false;
+  for (const char *p = s.begin; p < s.end; )
+    {
+      const char *next = LineEnd(p, s.end);
+      uint64_t a, b, c;
+      if (StartsWith(p, next, "addr = "))
+        {
+          const char *q = ParseHex(p + 7, next, &a);
+          if (q != NULL && (q = strstr(q, "PFN = ")) != NULL && q < next
+              && ParseHex(q + 6, next, &c) != NULL)
+            {
+              // PFN 0: the page went away
+              if (c != 0)
+                state[a >> pageShift] = c;
+              else
+                state.erase(a >> pageShift);
+            }
+        }
+      else if (StartsWith(p, next, "- "))
+        {
+          if (ParseRange(p + 2, next, &a, &b) != NULL)
+            state.erase(state.lower_bound(a >> pageShift),
+                        state.lower_bound(b >> pageShift));
+        }
+      else if (!full && IsHex(*p) && ParseRange(p, next, &a, &b) != NULL)
+        {
+          // a gen_PA.py dump lists every region, then every page
+          state.clear();
+          full = true;
+        }
+      p = next;
+    }
+}
+
+static char * PutNumber(char *o, uint64_t v, bool hex)
+{
+  char tmp[24];
+  int n = 0;
+  if (hex)
+    {
+      do
+        tmp[n++] = "0123456789abcdef"[v & 15];
+      while (v >>= 4);
+      *o++ = '0';
+      *o++ = 'x';
+    }
+  else
+    {
+      do
+        tmp[n++] = '0' + v % 10;
+      while (v /= 10);
+    }
+  while (n > 0)
+    *o++ = tmp[--n];
+  return o;
+}
+
+struct JOB
+{
+  const char *        begin;
+  const char *        end;
+  const PFN_TABLE *   table;
+  unsigned            pageShift;
+  std::vector<char>   out;
+};
+
+/*
+ * Translate the records of a job into its output buffer
+ */
+static void Translate(JOB *job)
+{
+  uint64_t pageMask = (1ULL << job->pageShift) - 1;
+  // every line gets at most a space and a 20 digit decimal (or 0x and
+  // 16 hex digits) PA longer, the last one maybe without its newline
+  size_t lines = 1;
+  for (const char *p = job->begin;
+       (p = (const char *) memchr(p, '\n', job->end - p)) != NULL; p++)
+    lines++;
+  job->out.resize((job->end - job->begin) + lines * 21);
+  char *o = &job->out[0];
+  for (const char *p = job->begin; p < job->end; )
+    {
+      const char *next = LineEnd(p, job->end);
+      uint64_t ip, ea, size, rw;
+      bool hex;
+      const char *q = NULL;
+      if (Classify(p, next) == LINE_RECORD
+          && (q = ParseNumber(p, next, &ip)) != NULL
+          && (q = ParseNumber(q, next, &ea, &hex)) != NULL)
+        {
+          const char *rest = q;
+          if ((q = ParseNumber(q, next, &size)) != NULL
+              && (q = ParseNumber(q, next, &rw)) != NULL)
+            {
+              // <IP> <EA>, then the PA, then the rest of the line as is
+              memcpy(o, p, rest - p);
+              o += rest - p;
+              *o++ = ' ';
+              uint64_t pfn = job->table->Lookup(ea >> job->pageShift);
+              o = PutNumber(o, pfn ? (pfn << job->pageShift) | (ea & pageMask) : 0, hex);
+              memcpy(o, rest, next - rest);
+              o += next - rest;
+              p = next;
+              continue;
+            }
+        }
+      memcpy(o, p, next - p);
+      o += next - p;
+      p = next;
+    }
+  job->out.resize(o - &job->out[0]);
+}
+
+/*
+ * Run fn over every job with nthreads threads, thread t taking the
+ * jobs t, t + nthreads, ...
+ */
+struct WORKER
+{
+  std::vector<JOB *> *  jobs;
+  size_t                first;
+  size_t                step;
+  void                  (*fn)(JOB *);
+};
+
+static void * WorkerMain(void *arg)
+{
+  WORKER *w = (WORKER *) arg;
+  for (size_t i = w->first; i < w->jobs->size(); i += w->step)
+    w->fn((*w->jobs)[i]);
+  return NULL;
+}
+
+static void RunJobs(std::vector<JOB *> &jobs, unsigned nthreads, void (*fn)(JOB *))
+{
+  std::vector<pthread_t> threads(nthreads);
+  std::vector<WORKER> workers(nthreads);
+  for (unsigned t = 0; t < nthreads; t++)
+    {
+      WORKER w = { &jobs, t, nthreads, fn };
+      workers[t] = w;
+      if (pthread_create(&threads[t], NULL, WorkerMain, &workers[t]) != 0)
+        {
+          // do it ourselves
+          WorkerMain(&workers[t]);
+          threads[t] = pthread_self();
+        }
+    }
+  for (unsigned t = 0; t < nthreads; t++)
+    if (!pthread_equal(threads[t], pthread_self()))
+      pthread_join(threads[t], NULL);
+}
+
+/*
+ * Cut [begin, end) into chunks of about size bytes on line boundaries
+ */
+static void Chunk(const char *begin, const char *end, size_t size,
+                  std::vector<std::pair<const char *, const char *> > &chunks)
+{
+  while (begin < end)
+    {
+      const char *stop = (size_t) (end - begin) > size ? LineEnd(begin + size, end) : end;
+      chunks.push_back(std::make_pair(begin, stop));
+      begin = stop;
+    }
+}
+
+// spans of the chunk of every job of the first pass
+static std::vector<std::vector<SPAN> > chunk_spans;
+static JOB * pass1_jobs;
+
+static void FindJobSpans(JOB *job)
+{
+  FindSpans(job->begin, job->end, chunk_spans[job - pass1_jobs]);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned pageShift = 12;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:p:")) != -1)
+    {
+      if (opt == 'j')
+        nthreads = atoi(optarg);
+      else if (opt == 'p')
+        {
+          pageShift = 0;
+          while ((1UL << pageShift) < strtoul(optarg, NULL, 0))
+            pageShift++;
+        }
+      else
+        optind = argc;
+    }
+  if (optind >= argc)
+    {
+      fprintf(stderr, "usage: %s [-j <threads>] [-p <page size>] <trace file> "
+              "[<output file>]\n", argv[0]);
+      return 1;
+    }
+  if (nthreads == 0)
+    nthreads = 1;
+
+  int fd = open(argv[optind], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      fprintf(stderr, "could not open %s\n", argv[optind]);
+      return 1;
+    }
+  FILE *out = stdout;
+  if (optind + 1 < argc && (out = fopen(argv[optind + 1], "w")) == NULL)
+    {
+      fprintf(stderr, "could not open %s\n", argv[optind + 1]);
+      return 1;
+    }
+  if (st.st_size == 0)
+    return 0;
+
+  const char *base = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED)
+    {
+      fprintf(stderr, "could not map %s\n", argv[optind]);
+      return 1;
+    }
+  madvise((void *) base, st.st_size, MADV_SEQUENTIAL);
+  const char *end = base + st.st_size;
+
+  // pass 1: where are the dumps
+  std::vector<std::pair<const char *, const char *> > chunks;
+  Chunk(base, end, st.st_size / nthreads + 1, chunks);
+  std::vector<JOB> pass1(chunks.size());
+  std::vector<JOB *> jobs;
+  for (size_t i = 0; i < chunks.size(); i++)
+    {
+      pass1[i].begin = chunks[i].first;
+      pass1[i].end = chunks[i].second;
+      jobs.push_back(&pass1[i]);
+    }
+  chunk_spans.resize(chunks.size());
+  pass1_jobs = &pass1[0];
+  RunJobs(jobs, nthreads, FindJobSpans);
+
+  std::vector<SPAN> spans;
+  for (size_t i = 0; i < chunk_spans.size(); i++)
+    for (size_t k = 0; k < chunk_spans[i].size(); k++)
+      {
+        const SPAN &s = chunk_spans[i][k];
+        if (!spans.empty() && spans.back().dump == s.dump && spans.back().end == s.begin)
+          spans.back().end = s.end;
+        else
+          spans.push_back(s);
+      }
+
+  // pass 2: dump by dump, translate the records before it
+  std::map<uint64_t, uint64_t> state;
+  PFN_TABLE table;
+  size_t pending = 0;
+  for (size_t i = 0; i <= spans.size(); i++)
+    {
+      if (i < spans.size() && !spans[i].dump)
+        continue;
+      if (i < spans.size())
+        {
+          ApplyDump(spans[i], state, pageShift);
+          table.Build(state);
+        }
+
+      // records since the previous dump, then the dump itself
+      // spread them over the threads even when there are few
+      size_t bytes = 0;
+      for (size_t k = pending; k < i; k++)
+        bytes += spans[k].end - spans[k].begin;
+      size_t batch = std::max<size_t>(std::min<size_t>(bytes / nthreads + 1, BATCH_SIZE),
+                                      MIN_BATCH_SIZE);
+      chunks.clear();
+      for (size_t k = pending; k < i; k++)
+        Chunk(spans[k].begin, spans[k].end, batch, chunks);
+      for (size_t c = 0; c < chunks.size(); c += nthreads)
+        {
+          std::vector<JOB> round(std::min<size_t>(nthreads, chunks.size() - c));
+          jobs.clear();
+          for (size_t k = 0; k < round.size(); k++)
+            {
+              round[k].begin = chunks[c + k].first;
+              round[k].end = chunks[c + k].second;
+              round[k].table = &table;
+              round[k].pageShift = pageShift;
+              jobs.push_back(&round[k]);
+            }
+          RunJobs(jobs, nthreads, Translate);
+          for (size_t k = 0; k < round.size(); k++)
+            if (!round[k].out.empty())
+              fwrite(&round[k].out[0], 1, round[k].out.size(), out);
+        }
+      if (i < spans.size())
+        fwrite(spans[i].begin, 1, spans[i].end - spans[i].begin, out);
+      pending = i + 1;
+    }
+
+  munmap((void *) base, st.st_size);
+  close(fd);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}